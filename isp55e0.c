@@ -16,6 +16,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* CPU affinity */
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -27,6 +31,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
 
 #ifdef WIN32
 #include "compat-err.h"
@@ -36,9 +41,33 @@
 #else
 #include <err.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #endif
 
+#include <time.h>
+#include <sys/time.h>
+#include <signal.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <glob.h>
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#endif
+
 #ifdef __APPLE__
 #include <libkern/OSByteOrder.h>
 
@@ -51,16 +80,105 @@
 /* Profile of supported chips */
 static const struct ch_profile profiles[] = {
 #include "chips.h"
+	{ }
+};
+
+static const char *cmd_names[N_CMDS] = {
+	[CMD_CHIP_TYPE - CMD_CHIP_TYPE] = "chip-type",
+	[CMD_REBOOT - CMD_CHIP_TYPE] = "reboot",
+	[CMD_SET_KEY - CMD_CHIP_TYPE] = "set-key",
+	[CMD_ERASE_CODE_FLASH - CMD_CHIP_TYPE] = "erase-code",
+	[CMD_WRITE_CODE_FLASH - CMD_CHIP_TYPE] = "write-code",
+	[CMD_CMP_CODE_FLASH - CMD_CHIP_TYPE] = "cmp-code",
+	[CMD_READ_CONFIG - CMD_CHIP_TYPE] = "read-config",
+	[CMD_WRITE_CONFIG - CMD_CHIP_TYPE] = "write-config",
+	[CMD_ERASE_DATA_FLASH - CMD_CHIP_TYPE] = "erase-data",
+	[CMD_WRITE_DATA_FLASH - CMD_CHIP_TYPE] = "write-data",
+	[CMD_READ_DATA_FLASH - CMD_CHIP_TYPE] = "read-data",
+};
+
+/* Supported bootloaders. 2.4.0 bootloaders do not respond to a
+ * reboot, 2.8.0 does. A failed compare breaks all the following
+ * ones until a power cycle. */
+static const struct bootloader_rules bootloader_rules[] = {
+	{ 0x020301, .wait_reboot_resp = false,
+	  .sticky_cmp_failure = true },
+	{ 0x020400, .wait_reboot_resp = false,
+	  .sticky_cmp_failure = true },
+	{ 0x020500, .wait_reboot_resp = true,
+	  .sticky_cmp_failure = true },
+	{ 0x020600, .wait_reboot_resp = true,
+	  .sticky_cmp_failure = true },
+	{ 0x020700, .wait_reboot_resp = true,
+	  .sticky_cmp_failure = true },
+	{ 0x020800, .wait_reboot_resp = true,
+	  .sticky_cmp_failure = true },
+	{ 0x020900, .wait_reboot_resp = true,
+	  .sticky_cmp_failure = true },
+	{ 0 }
+};
+
+static const char *step_names[] = {
+	[STEP_SET_KEY] = "set key",
+	[STEP_WRITE_CONFIG] = "write config",
+	[STEP_ERASE_CODE] = "erase code flash",
+	[STEP_WRITE_CODE] = "write code flash",
+	[STEP_VERIFY_CODE] = "verify code flash",
+	[STEP_ERASE_DATA] = "erase data flash",
+	[STEP_WRITE_DATA] = "write data flash",
+	[STEP_READ_DATA] = "read data flash",
+	[STEP_VERIFY_DATA] = "verify data flash",
+	[STEP_DUMP_DATA] = "dump data flash",
+	[STEP_REBOOT] = "reboot",
+};
+
+static const struct timeout_policy default_timeouts = {
+	.adaptive = true,
+	.fixed_ms = USB_TIMEOUT,
+	.initial_ms = 1000,
+	.min_ms = 100,
+	.rtt_factor = 4,
+	.erase_base_ms = 500,
+	.erase_ms_per_kib = 5,
 };
 
 static const struct option long_options[] = {
 	{ "code-verify", required_argument, 0, 'c' },
 	{ "debug", no_argument, 0,  'd' },
+	{ "erase-size", required_argument, 0,  'e' },
 	{ "code-flash", required_argument, 0,  'f' },
 	{ "help", no_argument, 0,  'h' },
 	{ "data-flash", required_argument, 0,  'k' },
 	{ "data-verify", required_argument, 0,  'l' },
+	{ "data-template", required_argument, 0,  'T' },
+	{ "patch", required_argument, 0,  'P' },
+	{ "interleave", optional_argument, 0,  'i' },
+	{ "emulate", required_argument, 0,  'E' },
+	{ "dry-run", required_argument, 0,  'y' },
+	{ "model", required_argument, 0,  'M' },
+	{ "budget", required_argument, 0,  'B' },
+	{ "faults", required_argument, 0,  'X' },
+	{ "retries", required_argument, 0,  'N' },
+	{ "deadline", required_argument, 0,  'a' },
+	{ "progress", required_argument, 0,  'g' },
 	{ "data-dump", required_argument, 0,  'm' },
+	{ "no-plan", no_argument, 0,  'n' },
+	{ "query", required_argument, 0,  'q' },
+	{ "record", required_argument, 0,  'R' },
+	{ "harvest", required_argument, 0,  'H' },
+	{ "route", required_argument, 0,  'r' },
+	{ "job", required_argument, 0,  'J' },
+	{ "scan", no_argument, 0,  'S' },
+	{ "discover", optional_argument, 0,  'D' },
+	{ "gang", no_argument, 0,  'G' },
+	{ "realtime", optional_argument, 0,  'F' },
+	{ "watch", no_argument, 0,  'W' },
+	{ "enter", required_argument, 0,  'b' },
+	{ "wait-app", optional_argument, 0,  'w' },
+	{ "reset", required_argument, 0,  'x' },
+	{ "link-bench", optional_argument, 0,  'L' },
+	{ "stats", no_argument, 0,  's' },
+	{ "timeouts", required_argument, 0,  't' },
 #ifndef WIN32
 	{ "port", required_argument, 0,  'p' },
 #endif
@@ -72,17 +190,83 @@ static void usage(void)
 	printf("ISP programmer for some WinChipHead MCUs\n");
 	printf("Options:\n");
 #ifndef WIN32
-	printf("  --port, -p          use serial port instead of usb\n");
+	printf("  --port, -p          use serial port instead of usb, can be repeated\n");
 #endif
-	printf("  --code-flash, -f    firmware to flash\n");
+	printf("  --code-flash, -f    firmware to flash, or - for stdin\n");
+	printf("  --erase-size, -e    code flash to erase when streaming\n");
 	printf("  --code-verify, -c   verify existing firwmare\n");
 	printf("  --data-flash, -k    data to flash\n");
 	printf("  --data-verify, -l   verify existing data\n");
+	printf("  --data-template, -T render the data to flash from a template\n");
+	printf("  --patch, -P         patch a value in the firmware, can be repeated\n");
+	printf("                      OFFSET:WIDTH:counter=FILE|counter-str=FILE|id|id-str\n");
+	printf("                      |list=FILE[:utf16]\n");
 	printf("  --data-dump, -m     dump the data flash to a file\n");
+	printf("  --route, -r         pick the files to flash from a routing table\n");
+	printf("  --job, -J           run the operations of a job manifest\n");
+	printf("  --no-plan, -n       send every command, even redundant ones\n");
+	printf("  --interleave, -i    verify while flashing, every n chunks (16)\n");
+	printf("  --emulate, -E       talk to an emulated chip, CHIP[,VERSION][,serial]\n");
+	printf("  --dry-run, -y       count the commands sent to a chip, CHIP[,VERSION][,serial]\n");
+	printf("  --model, -M         estimate the dry run time from a --stats output\n");
+	printf("  --budget, -B        fail if more commands or bytes than in a budget file\n");
+	printf("  --faults, -X        make the emulated link lossy, seed=N,latency=ms,\n");
+	printf("                      jitter=ms,dist=uniform|normal,drop=P,truncate=P,\n");
+	printf("                      corrupt=P,stall=P,stall-ms=ms\n");
+	printf("  --retries, -N       send a command again when its response is lost\n");
+	printf("  --deadline, -a      stop a session after that many ms, between two\n");
+	printf("                      commands, like on SIGINT or SIGTERM\n");
+#ifndef WIN32
+	printf("  --record, -R        append each session to a flight recorder file\n");
+	printf("  --harvest, -H       append the data flash to an archive\n");
+	printf("  --query, -q         query the recorder, id=HEX or time=FROM..TO, or the\n");
+	printf("                      archive, list, extract=KEY[,FILE] or diff=KEY,KEY\n");
+#endif
+#ifndef WIN32
+	printf("  --scan, -S          list all the devices and serial ports, in JSON\n");
+	printf("  --discover, -D      find the bootloaders on serial ports, and use them\n");
+	printf("                      [=GLOB,...], default is the USB serial ports\n");
+#endif
+#ifdef __linux__
+	printf("  --gang, -G          flash all the USB devices at once, sharing the hubs\n");
+	printf("  --realtime, -F      lock the memory and use a real time policy for the\n");
+	printf("                      transfers, [=fifo|rr][,prio=N][,cpus=2-5+7]\n");
+	printf("  --watch, -W         flash the firmware again each time it changes\n");
+#endif
+#ifndef WIN32
+	printf("  --progress, -g      write progress records to a fd or a FIFO\n");
+	printf("  --enter, -b         line sequence to enter the bootloader, retried\n");
+	printf("  --reset, -x         line sequence to start the application\n");
+	printf("                      dtr=0|1,rts=0|1,wait=ms,gpio=CHIP:LINE=0|1,...\n");
+#endif
+	printf("  --wait-app, -w      wait for the application to enumerate after the\n");
+	printf("                      reboot, [=VID:PID][,deadline=ms]\n");
+	printf("  --link-bench, -L    measure the link, [=FILE] to compare with a baseline\n");
+	printf("  --stats, -s         print the transfer statistics\n");
+	printf("  --timeouts, -t      timeout policy, fixed[=ms] or adaptive[,factor=n]\n");
+	printf("                      [,min=ms][,initial=ms][,erase-base=ms][,erase-kib=ms]\n");
 	printf("  --debug, -d         turn debug traces on\n");
 	printf("  --help, -h          this help\n");
 }
 
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int64_t wall_clock_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static void hexdump(const char *name, const void *data, int len)
 {
 	const uint8_t *p = data;
@@ -99,33 +283,277 @@ static void hexdump(const char *name, const void *data, int len)
 }
 
 #ifndef WIN32
-static void open_serial_device(struct device *dev, char *port)
+/* GPIO lines used by the line sequences */
+static struct gpio_line gpio_lines[MAX_GPIO_LINES];
+static int n_gpio_lines;
+
+/* Find or add a GPIO line, given as CHIP:LINE */
+static int parse_gpio_line(char *spec)
+{
+	struct gpio_line *line;
+	char *sep;
+	int i;
+
+	sep = strrchr(spec, ':');
+	if (sep == NULL || sep == spec)
+		errx(EXIT_FAILURE, "Invalid GPIO line '%s', use CHIP:LINE", spec);
+	*sep = '\0';
+
+	for (i = 0; i < n_gpio_lines; i++) {
+		if (strcmp(gpio_lines[i].chip, spec) == 0 &&
+		    gpio_lines[i].offset == strtoul(sep + 1, NULL, 0))
+			return i;
+	}
+
+	if (n_gpio_lines == MAX_GPIO_LINES)
+		errx(EXIT_FAILURE, "Too many GPIO lines");
+
+	line = &gpio_lines[n_gpio_lines];
+	snprintf(line->chip, sizeof(line->chip), "%s", spec);
+	line->offset = strtoul(sep + 1, NULL, 0);
+	line->fd = -1;
+
+	return n_gpio_lines++;
+}
+
+/* Parse a line sequence, such as rts=0,dtr=0,wait=20,dtr=1 */
+static void parse_line_seq(struct line_seq *seq, char *spec)
+{
+	struct line_action *action;
+	char *token;
+	char *value;
+
+	seq->n = 0;
+
+	for (token = strtok(spec, ","); token; token = strtok(NULL, ",")) {
+		if (seq->n == MAX_LINE_ACTIONS)
+			errx(EXIT_FAILURE, "Line sequence is too long");
+
+		action = &seq->actions[seq->n++];
+
+		value = strrchr(token, '=');
+		if (value == NULL)
+			errx(EXIT_FAILURE, "Invalid line action '%s'", token);
+		*value++ = '\0';
+
+		action->value = strtol(value, NULL, 0);
+
+		if (strcmp(token, "dtr") == 0)
+			action->op = LINE_DTR;
+		else if (strcmp(token, "rts") == 0)
+			action->op = LINE_RTS;
+		else if (strcmp(token, "wait") == 0)
+			action->op = LINE_WAIT;
+		else if (strncmp(token, "gpio=", 5) == 0) {
+			action->op = LINE_GPIO;
+			action->gpio = parse_gpio_line(token + 5);
+		} else
+			errx(EXIT_FAILURE, "Invalid line action '%s'", token);
+	}
+}
+
+static void set_gpio_line(struct gpio_line *line, int value)
+{
+#if defined(__linux__) && defined(GPIO_V2_GET_LINE_IOCTL)
+	struct gpio_v2_line_values values = {
+		.bits = value ? 1 : 0,
+		.mask = 1,
+	};
+
+	if (line->fd == -1) {
+		struct gpio_v2_line_request req = {
+			.offsets[0] = line->offset,
+			.consumer = "isp55e0",
+			.config.flags = GPIO_V2_LINE_FLAG_OUTPUT,
+			.config.num_attrs = 1,
+			.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES,
+			.config.attrs[0].attr.values = values.bits,
+			.config.attrs[0].mask = 1,
+			.num_lines = 1,
+		};
+		int chip_fd;
+
+		chip_fd = open(line->chip, O_RDWR | O_CLOEXEC);
+		if (chip_fd == -1)
+			err(EXIT_FAILURE, "Can't open the GPIO chip %s", line->chip);
+
+		/* The line keeps its level as long as it is held */
+		if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) == -1)
+			err(EXIT_FAILURE, "Can't get the GPIO line %s:%u",
+			    line->chip, line->offset);
+
+		close(chip_fd);
+		line->fd = req.fd;
+		return;
+	}
+
+	if (ioctl(line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == -1)
+		err(EXIT_FAILURE, "Can't set the GPIO line %s:%u",
+		    line->chip, line->offset);
+#else
+	errx(EXIT_FAILURE, "GPIO lines are not supported on this system");
+#endif
+}
+
+/* Play a line sequence. dtr=1 and rts=1 assert the signals, which
+ * usually drives the pins low. */
+static void run_line_seq(struct device *dev, const struct line_seq *seq)
+{
+	const struct line_action *action;
+	struct timespec ts;
+	int bits;
+	int i;
+
+	for (i = 0; i < seq->n; i++) {
+		action = &seq->actions[i];
+
+		switch (action->op) {
+		case LINE_DTR:
+		case LINE_RTS:
+			bits = action->op == LINE_DTR ? TIOCM_DTR : TIOCM_RTS;
+			if (ioctl(dev->fd, action->value ? TIOCMBIS : TIOCMBIC,
+				  &bits) == -1)
+				err(EXIT_FAILURE, "Can't set the modem lines");
+			break;
+
+		case LINE_GPIO:
+			set_gpio_line(&gpio_lines[action->gpio], action->value);
+			break;
+
+		case LINE_WAIT:
+			ts.tv_sec = action->value / 1000;
+			ts.tv_nsec = (action->value % 1000) * 1000000L;
+			while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+				;
+			break;
+		}
+	}
+}
+#endif
+
+/* Escape a character of a JSON string. Returns the length written
+ * to out, at most JSON_ESCAPE_MAX. */
+static int json_escape(char *out, char c)
+{
+	if (c == '"' || c == '\\')
+		return sprintf(out, "\\%c", c);
+	if ((unsigned char)c < 0x20)
+		return sprintf(out, "\\u%04x", c);
+
+	out[0] = c;
+
+	return 1;
+}
+
+/* Write a progress record. Records are rate limited, except at the
+ * start and the end of a phase, and are dropped rather than wait for
+ * a slow reader. */
+static void progress(struct progress *p, const char *phase, size_t done,
+		     size_t total)
+{
+	double now;
+	double rate;
+	double avg;
+	double eta;
+	char name[128];
+	char record[384];
+	const char *c;
+	size_t name_len = 0;
+	int len;
+
+	if (p->fd == -1)
+		return;
+
+	now = now_ms();
+
+	if (phase != p->phase) {
+		p->phase = phase;
+		p->start_ms = now;
+		p->last_ms = now;
+		p->last_done = 0;
+	} else if (done != total && now - p->last_ms < PROGRESS_INTERVAL_MS) {
+		return;
+	}
+
+	rate = now > p->last_ms ?
+		(done - p->last_done) * 1000.0 / (now - p->last_ms) : 0;
+	avg = now > p->start_ms ? done * 1000.0 / (now - p->start_ms) : 0;
+	eta = avg > 0 ? (total - done) / avg : 0;
+
+	/* The name comes from the command line or the system, and is
+	 * cut if it is too long */
+	for (c = p->name; *c && name_len + JSON_ESCAPE_MAX < sizeof(name); c++)
+		name_len += json_escape(&name[name_len], *c);
+	name[name_len] = '\0';
+
+	len = snprintf(record, sizeof(record),
+		       "{\"device\": \"%s\", \"phase\": \"%s\", "
+		       "\"done\": %zu, \"total\": %zu, \"rate\": %.0f, "
+		       "\"avg\": %.0f, \"eta\": %.2f}\n",
+		       name, phase, done, total, rate, avg, eta);
+
+	/* A single write, so the records of several boards don't mix.
+	 * Stop reporting if the reader went away. */
+	if (write(p->fd, record, len) == -1 && errno != EAGAIN)
+		p->fd = -1;
+
+	p->last_ms = now;
+	p->last_done = done;
+}
+
+/* Progress of the step being run */
+static void step_progress(struct device *dev, size_t done, size_t total)
+{
+	if (dev->step >= 0)
+		progress(&dev->progress, step_names[dev->step], done, total);
+}
+
+#ifndef WIN32
+/* Open the progress channel, a fd number or a path, usually a FIFO */
+static int open_progress(const char *target)
+{
+	int fd;
+
+	if (target[0] && strspn(target, "0123456789") == strlen(target)) {
+		fd = atoi(target);
+	} else {
+		fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK,
+			  0644);
+		if (fd == -1 && errno == ENXIO)
+			errx(EXIT_FAILURE, "Nothing reads the progress FIFO %s",
+			     target);
+	}
+
+	if (fd == -1 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "Can't use %s for the progress", target);
+
+	/* A reader going away must not kill the session */
+	signal(SIGPIPE, SIG_IGN);
+
+	return fd;
+}
+
+/* Configure a serial port for the bootloader. Returns 0 on success. */
+static int setup_serial_port(int fd)
 {
 	int ret;
 	struct termios options;
 	int status;
 	speed_t baud = B115200;
 
-	if ((dev->fd = open(port, O_RDWR | O_NOCTTY)) == -1)
-		errx(EXIT_FAILURE, "Error occured while opening serial port '%s'", port);
-
-	ret = fcntl(dev->fd, F_SETFL, O_RDWR) ;
-	if (ret < 0)
-		goto fail;
-
-	ret = tcgetattr(dev->fd, &options);
+	ret = tcgetattr(fd, &options);
 	if (ret < 0)
-		goto fail;
+		return ret;
 
 	cfmakeraw(&options);
 
 	ret = cfsetispeed(&options, baud);
 	if (ret < 0)
-		goto fail;
+		return ret;
 
 	ret = cfsetospeed(&options, baud);
 	if (ret < 0)
-		goto fail;
+		return ret;
 
 	options.c_cflag |= (CLOCAL | CREAD) ;
 	options.c_cflag &= ~(PARENB | CSTOPB | CSIZE) ;
@@ -137,30 +565,152 @@ static void open_serial_device(struct device *dev, char *port)
 	/* Disable any special handling of received bytes */
 	options.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
 
-	options.c_cc [VMIN]  = 64;
-	options.c_cc [VTIME] = SERIAL_TIMEOUT;
+	/* Reads are timed with poll() */
+	options.c_cc [VMIN]  = 0;
+	options.c_cc [VTIME] = 0;
 
-	ret = tcsetattr(dev->fd, TCSANOW, &options) ;
+	ret = tcsetattr(fd, TCSANOW, &options) ;
 	if (ret < 0)
-		goto fail;
+		return ret;
 
-	ret = ioctl(dev->fd, TIOCMGET, &status);
+	ret = ioctl(fd, TIOCMGET, &status);
 	if (ret < 0)
-		goto fail;
+		return ret;
 
 	status |= TIOCM_DTR;
 	status |= TIOCM_RTS;
 
-	ret = ioctl(dev->fd, TIOCMSET, &status);
+	return ioctl(fd, TIOCMSET, &status);
+}
+
+#ifdef __linux__
+/* FTDI latency timers which were lowered, to put back on exit */
+static struct latency_timer latency_timers[MAX_PORTS];
+static int n_latency_timers;
+
+static void restore_latency_timers(void)
+{
+	int fd;
+	int i;
+
+	for (i = 0; i < n_latency_timers; i++) {
+		fd = open(latency_timers[i].path, O_WRONLY);
+		if (fd == -1)
+			continue;
+
+		if (write(fd, latency_timers[i].value,
+			  strlen(latency_timers[i].value)) == -1)
+			warn("Can't restore %s", latency_timers[i].path);
+		close(fd);
+	}
+}
+
+/* Set the latency timer of an FTDI adapter to 1 ms, saving its value
+ * first. Returns whether it is that low. */
+static bool set_latency_timer(const char *path)
+{
+	struct latency_timer *lt;
+	ssize_t len;
+	bool ok;
+	int fd;
+	int i;
+
+	for (i = 0; i < n_latency_timers; i++) {
+		if (strcmp(latency_timers[i].path, path) == 0)
+			return true;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		return false;
+
+	lt = &latency_timers[n_latency_timers];
+	len = read(fd, lt->value, sizeof(lt->value) - 1);
+	if (len <= 0) {
+		close(fd);
+		return false;
+	}
+	lt->value[len] = '\0';
+
+	if (atoi(lt->value) == 1) {
+		close(fd);
+		return true;
+	}
+
+	/* Not lowered if it couldn't be put back */
+	if (n_latency_timers == MAX_PORTS) {
+		close(fd);
+		return false;
+	}
+
+	ok = pwrite(fd, "1", 1, 0) == 1;
+	close(fd);
+
+	if (ok) {
+		snprintf(lt->path, sizeof(lt->path), "%s", path);
+		if (n_latency_timers++ == 0)
+			atexit(restore_latency_timers);
+	}
+
+	return ok;
+}
+#endif
+
+/* Ask the USB-serial adapter to forward received bytes immediately,
+ * instead of batching them for a few milliseconds. Returns whether
+ * the driver accepted. */
+static bool set_serial_low_latency(int fd, const char *port)
+{
+	bool low_latency = false;
+#ifdef __linux__
+	struct serial_struct serial;
+	char path[PATH_MAX];
+	char *real;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		low_latency = ioctl(fd, TIOCSSERIAL, &serial) == 0;
+	}
+
+	/* FTDI adapters have their own latency timer, 16ms by default */
+	real = realpath(port, NULL);
+	if (real == NULL)
+		return low_latency;
+
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer",
+		 basename(real));
+	free(real);
+
+	if (set_latency_timer(path))
+		low_latency = true;
+#endif
+
+	return low_latency;
+}
+
+static void open_serial_device(struct device *dev, char *port)
+{
+	int ret;
+
+	if ((dev->fd = open(port, O_RDWR | O_NOCTTY)) == -1)
+		errx(EXIT_FAILURE, "Error occured while opening serial port '%s'", port);
+
+	ret = fcntl(dev->fd, F_SETFL, O_RDWR) ;
 	if (ret < 0)
 		goto fail;
 
+	ret = setup_serial_port(dev->fd);
+	if (ret < 0)
+		goto fail;
+
+	dev->low_latency = set_serial_low_latency(dev->fd, port);
+
 	return;
 fail:
 	errx(EXIT_FAILURE, "Error occured while configuring serial port");
 }
 
-static unsigned char serial_crc(unsigned char *req, int req_len)
+static unsigned char serial_crc(const unsigned char *req, int req_len)
 {
 	unsigned char crc = 0;
 
@@ -170,22 +720,59 @@ static unsigned char serial_crc(unsigned char *req, int req_len)
 
 	return crc;
 }
-#endif
 
-/* Open and claim the USB device */
-static void open_usb_device(struct device *dev)
+/* Read len bytes from the serial port, before the deadline */
+static int serial_read(int fd, void *buf, int len, double deadline)
 {
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	int total_read = 0;
+	int remaining;
 	int ret;
 
-	ret = libusb_init(NULL);
-	if (ret)
-		errx(EXIT_FAILURE, "Can't initialize USB");
+	while (total_read < len) {
+		remaining = deadline - now_ms();
+		if (remaining <= 0)
+			return -ETIMEDOUT;
 
-	dev->usb_h = libusb_open_device_with_vid_pid(NULL, 0x4348, 0x55e0);
-	if (dev->usb_h == NULL)
-		dev->usb_h = libusb_open_device_with_vid_pid(NULL, 0x1a86, 0x55e0);
-	if (dev->usb_h == NULL)
-		errx(EXIT_FAILURE, "No CH5xx devices found in ISP mode");
+		ret = poll(&pfd, 1, remaining);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -EIO;
+		if (ret == 0)
+			return -ETIMEDOUT;
+
+		ret = read(fd, (uint8_t *)buf + total_read, len - total_read);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret <= 0)
+			return -EIO;
+
+		total_read += ret;
+	}
+
+	return 0;
+}
+
+/* Wrap a request into a serial frame. Returns the frame length. */
+static int serial_frame(uint8_t *frame, const void *req, int req_len)
+{
+	frame[0] = SERIAL_REQ_MAGIC1;
+	frame[1] = SERIAL_REQ_MAGIC2;
+	memcpy(&frame[2], req, req_len);
+	frame[2 + req_len] = serial_crc(req, req_len);
+
+	return req_len + 3;
+}
+#endif
+
+/* Claim an opened USB device */
+static void claim_usb_device(struct device *dev)
+{
+	int ret;
 
 #ifndef WIN32
 	/* it seems WIN32 libusb doesn't support this */
@@ -199,523 +786,6297 @@ static void open_usb_device(struct device *dev)
 		errx(EXIT_FAILURE, "Can't claim the USB device\n");
 }
 
-/* Send a request, get a reply */
-static int transfer(struct device *dev, void *req, int req_len,
-		    void *resp, int resp_len)
+/* Open and claim the USB device */
+static void open_usb_device(struct device *dev)
 {
-	int len;
 	int ret;
-#ifndef WIN32
-	int serial_transmitted;
-	unsigned char req_serial_prefix[2] = {SERIAL_REQ_MAGIC1, SERIAL_REQ_MAGIC2};
-	unsigned char req_serial_crc[1] = {serial_crc(req, req_len)};
-	unsigned char resp_serial_prefix[2];
-	unsigned char resp_serial_crc[1];
-
-	if (dev->fd) {
-		/* Serial port case */
-		serial_transmitted = write(dev->fd, req_serial_prefix, sizeof(req_serial_prefix));
-		serial_transmitted += write(dev->fd, req, req_len);
-		serial_transmitted += write(dev->fd, req_serial_crc, sizeof(req_serial_crc));
 
-		if (serial_transmitted != (sizeof(req_serial_prefix)+req_len+sizeof(req_serial_crc)))
-			errx(EXIT_FAILURE, "Serial port write error");
-
-		if (dev->debug)
-			hexdump("request", req, req_len);
-
-		serial_transmitted = read(dev->fd, resp_serial_prefix, sizeof(resp_serial_prefix));
-		if (serial_transmitted != sizeof(resp_serial_prefix) || resp_serial_prefix[0] != SERIAL_RESP_MAGIC1 || resp_serial_prefix[1] != SERIAL_RESP_MAGIC2)
-			errx(EXIT_FAILURE, "Serial port response magic read error");
-
-		serial_transmitted = read(dev->fd, resp, resp_len);
-		if (serial_transmitted != resp_len)
-			errx(EXIT_FAILURE, "Serial port response read error");
-
-		serial_transmitted = read(dev->fd, resp_serial_crc, sizeof(resp_serial_crc));
-		if (serial_transmitted != sizeof(resp_serial_crc) || resp_serial_crc[0] != serial_crc(resp, resp_len))
-			errx(EXIT_FAILURE, "Serial port response crc read error");
+	ret = libusb_init(NULL);
+	if (ret)
+		errx(EXIT_FAILURE, "Can't initialize USB");
 
-		if (dev->debug)
-			hexdump("response", resp, resp_len);
+	dev->usb_h = libusb_open_device_with_vid_pid(NULL, 0x4348, 0x55e0);
+	if (dev->usb_h == NULL)
+		dev->usb_h = libusb_open_device_with_vid_pid(NULL, 0x1a86, 0x55e0);
+	if (dev->usb_h == NULL)
+		errx(EXIT_FAILURE, "No CH5xx devices found in ISP mode");
 
-	} else {
-#endif
-		/* USB case */
-		ret = libusb_bulk_transfer(dev->usb_h, EP_OUT, req, req_len,
-				   &len, USB_TIMEOUT);
-		if (ret)
-			return -EIO;
+	claim_usb_device(dev);
+}
 
-		if (dev->debug)
-			hexdump("request", req, len);
+static bool is_isp_device(libusb_device *usb_dev)
+{
+	struct libusb_device_descriptor desc;
 
-		ret = libusb_bulk_transfer(dev->usb_h, EP_IN, resp, resp_len,
-				   &len, USB_TIMEOUT);
-		if (ret)
-			return -EIO;
+	if (libusb_get_device_descriptor(usb_dev, &desc))
+		return false;
 
-		if (dev->debug)
-			hexdump("response", resp, len);
+	return (desc.idVendor == 0x4348 || desc.idVendor == 0x1a86) &&
+		desc.idProduct == 0x55e0;
+}
 
-#ifndef WIN32
-	}
-#endif
+static void usb_location(libusb_device *usb_dev, struct location *loc)
+{
+	int len;
+	int i;
 
-	return 0;
+	memset(loc, 0, sizeof(*loc));
+	loc->bus = libusb_get_bus_number(usb_dev);
+	loc->path_len = libusb_get_port_numbers(usb_dev, loc->path,
+						sizeof(loc->path));
+	if (loc->path_len < 0)
+		loc->path_len = 0;
+
+	len = snprintf(loc->name, sizeof(loc->name), "usb:%u-", loc->bus);
+	for (i = 0; i < loc->path_len; i++)
+		len += snprintf(loc->name + len, sizeof(loc->name) - len,
+				"%s%u", i ? "." : "", loc->path[i]);
 }
 
-static void set_chip_profile(struct device *dev, uint8_t family, uint8_t type)
+/* Name the transaction translator a full speed device sits behind:
+ * the first high speed hub up the tree, down to the hub port when that
+ * hub has one TT per port. Without such hub, the device shares the
+ * bandwidth of its root port only. */
+static void usb_tt_group(libusb_device *usb_dev, struct location *loc)
 {
-	const struct ch_profile *profile = profiles;
-
-	while (profile->name) {
-		if (profile->family == family && profile->type == type) {
-			dev->profile = profile;
-			dev->fw.max_flash_size = profile->code_flash_size;
-			dev->data.max_flash_size = profile->data_flash_size;
-			dev->data_dump.max_flash_size = profile->data_flash_size;
+	struct libusb_device_descriptor desc;
+	libusb_device *child = usb_dev;
+	libusb_device *hub;
+	struct location hub_loc;
+
+	while ((hub = libusb_get_parent(child)) != NULL &&
+	       libusb_get_parent(hub) != NULL) {
+		if (libusb_get_device_speed(hub) == LIBUSB_SPEED_HIGH) {
+			usb_location(hub, &hub_loc);
+
+			/* Multi-TT hubs have the protocol set to 2 */
+			if (libusb_get_device_descriptor(hub, &desc) == 0 &&
+			    desc.bDeviceProtocol == 2)
+				snprintf(loc->group, sizeof(loc->group),
+					 "%.56s.%u", hub_loc.name,
+					 libusb_get_port_number(child));
+			else
+				snprintf(loc->group, sizeof(loc->group), "%s",
+					 hub_loc.name);
 			return;
 		}
 
-		profile++;
+		child = hub;
 	}
 
-	errx(EXIT_FAILURE, "Device family 0x%02x type 0x%02x is not supported\n",
-	     family, type);
+	snprintf(loc->group, sizeof(loc->group), "usb:%u-%u", loc->bus,
+		 loc->path_len ? loc->path[0] : 0);
 }
 
-static void read_chip_type(struct device *dev)
+/* List the USB devices in ISP mode. Returns how many were found. */
+static int enumerate_usb_devices(struct location **locs_out)
 {
-	struct req_get_chip_type req = {
-		.hdr.command = CMD_CHIP_TYPE,
-		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
-		.string = "MCU ISP & WCH.CN",
-	};
-	struct resp_chip_type resp;
-	int ret;
+	struct location *locs = NULL;
+	libusb_device **list;
+	ssize_t count;
+	ssize_t i;
+	int n = 0;
 
-	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
-	if (ret)
-		errx(EXIT_FAILURE, "Can't get the device type");
+	if (libusb_init(NULL))
+		errx(EXIT_FAILURE, "Can't initialize USB");
 
-	if (resp.family == 0)
-		errx(EXIT_FAILURE, "Chip is hosed. Reset or power cycle it.");
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0)
+		errx(EXIT_FAILURE, "Can't list the USB devices");
 
-	set_chip_profile(dev, resp.family, resp.type);
+	for (i = 0; i < count; i++) {
+		if (!is_isp_device(list[i]))
+			continue;
+
+		locs = realloc(locs, (n + 1) * sizeof(*locs));
+		if (locs == NULL)
+			errx(EXIT_FAILURE, "Can't allocate the device list");
+
+		usb_location(list[i], &locs[n]);
+		usb_tt_group(list[i], &locs[n]);
+		n++;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	/* The sessions will run in other processes, which can't share
+	 * a libusb context */
+	libusb_exit(NULL);
+
+	*locs_out = locs;
+
+	return n;
 }
 
-static void read_config(struct device *dev)
+/* Parse [VID:PID][,deadline=ms] */
+static void parse_app_wait(struct app_wait *wait, char *spec)
 {
-	struct req_read_config req = {
-		.hdr.command = CMD_READ_CONFIG,
-		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
-		.what = 0x1f,
-	};
-	struct resp_read_config resp;
-	int ret;
+	unsigned int vid, pid;
+	char *token;
 
-	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
-	if (ret)
-		errx(EXIT_FAILURE, "Can't get the device configuration");
+	memset(wait, 0, sizeof(*wait));
+	wait->deadline_ms = APP_WAIT_DEADLINE_MS;
+#ifndef WIN32
+	pthread_mutex_init(&wait->lock, NULL);
+#endif
+
+	if (spec == NULL)
+		return;
 
-	dev->bv = be32toh(resp.bootloader_version);
-	memcpy(dev->id, resp.id, dev->profile->mcu_id_len);
-	memcpy(dev->config_data, resp.config_data, sizeof(dev->config_data));
+	for (token = strtok(spec, ","); token; token = strtok(NULL, ",")) {
+		if (strncmp(token, "deadline=", 9) == 0)
+			wait->deadline_ms = strtoul(token + 9, NULL, 0);
+		else if (sscanf(token, "%x:%x", &vid, &pid) == 2) {
+			wait->vid = vid;
+			wait->pid = pid;
+		} else
+			errx(EXIT_FAILURE, "Invalid application to wait for '%s'",
+			     token);
+	}
 }
 
-/* Write some configuration. Hardcoded for now. */
-static void write_config(struct device *dev)
+/* Whether a device is the awaited application */
+static bool is_app_device(const struct app_wait *wait, libusb_device *usb_dev)
 {
-	struct req_write_config req = {
-		.hdr.command = CMD_WRITE_CONFIG,
-		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
-		.what = 0x07,
-	};
-	struct resp_write_config resp;
-	int ret;
+	struct libusb_device_descriptor desc;
+	struct location loc;
 
-	memcpy(req.config_data, dev->config_data, sizeof(req.config_data));
+	if (libusb_get_device_descriptor(usb_dev, &desc))
+		return false;
 
-	if (dev->profile->need_remove_wp && req.config_data[0] == 0xff)
-		req.config_data[0] = 0xa5;
+	if (wait->vid)
+		return desc.idVendor == wait->vid && desc.idProduct == wait->pid;
 
-	if (dev->profile->clear_cfg_rom_read) {
-		/* CH579 - the CFG_ROM_READ must be cleared, otherwise
-		 * flashing will fail.
-		 */
-		req.config_data[8] &= ~0x80;
-	}
+	/* Otherwise, anything but the bootloader on the same port */
+	usb_location(usb_dev, &loc);
 
-	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
-	if (ret)
-		errx(EXIT_FAILURE, "Can't write the new configuration");
+	return strcmp(loc.name, wait->isp.name) == 0 && !is_isp_device(usb_dev);
 }
 
-/* Erase the flash */
-static void erase_code_flash(struct device *dev)
+/* Whether a device was already there before the reboot */
+static bool was_present(const struct app_wait *wait, libusb_device *usb_dev)
 {
-	struct req_erase_flash req = {
-		.hdr.command = CMD_ERASE_CODE_FLASH,
-		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
-	};
-	struct resp_erase_flash resp;
-	int length;
-	int ret;
-
-	/* Erase length is in KiB blocks, with a minimum of 8KiB */
-	length = ((dev->fw.len + 1023) & ~1023) / 1024;
-	if (length < 8)
-		length = 8;
+	struct location loc;
+	int i;
 
-	req.length = length;
+	usb_location(usb_dev, &loc);
 
-	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
-	if (ret)
-		errx(EXIT_FAILURE, "Can't erase the code flash");
+	for (i = 0; i < wait->n_present; i++) {
+		if (strcmp(wait->present[i].name, loc.name) == 0)
+			return true;
+	}
 
-	if (resp.return_code != 0x00)
-		errx(EXIT_FAILURE, "The device refused to erase the code flash");
+	return false;
 }
 
-static void load_file(struct device *dev, struct content *info)
+static void app_event(struct app_wait *wait, libusb_device *usb_dev,
+		      bool arrived)
 {
-	struct stat statbuf;
-	int ret;
-	int fd;
-	off_t total_read = 0;
-	int open_flags = O_RDONLY;
+	struct libusb_device_descriptor desc;
+	struct location loc;
+	double now = now_ms();
+
+	if (!arrived) {
+		if (wait->isp_on_usb && !wait->left_ms && is_isp_device(usb_dev)) {
+			usb_location(usb_dev, &loc);
+			if (strcmp(loc.name, wait->isp.name) == 0)
+				wait->left_ms = now;
+		}
+		return;
+	}
 
-#ifdef WIN32
-	open_flags |= O_BINARY;
+	if (wait->arrived_ms || !is_app_device(wait, usb_dev) ||
+	    was_present(wait, usb_dev))
+		return;
+
+	usb_location(usb_dev, &loc);
+	if (libusb_get_device_descriptor(usb_dev, &desc))
+		memset(&desc, 0, sizeof(desc));
+
+#ifndef WIN32
+	pthread_mutex_lock(&wait->lock);
+#endif
+	wait->app = loc;
+	wait->app_vid = desc.idVendor;
+	wait->app_pid = desc.idProduct;
+	wait->arrived_ms = now;
+#ifndef WIN32
+	pthread_mutex_unlock(&wait->lock);
 #endif
+}
 
-	fd = open(info->filename, open_flags);
-	if (fd == -1)
-		err(EXIT_FAILURE, "Can't open the firmware file");
+static int LIBUSB_CALL app_hotplug(libusb_context *ctx, libusb_device *usb_dev,
+				   libusb_hotplug_event event, void *data)
+{
+	app_event(data, usb_dev, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
 
-	ret = fstat(fd, &statbuf);
-	if (ret == -1)
-		err(EXIT_FAILURE, "Can't get firmware file size");
+	return 0;
+}
 
-	/* Round up to 8 bytes boundary as upload protocol requires
-	 * it. Extra bytes are zeroes. */
-	info->len = (statbuf.st_size + 7) & ~7;
+/* Remember the devices which could pass for the application before
+ * the reboot, so that they are not taken for it */
+static void snapshot_app_devices(struct app_wait *wait)
+{
+	libusb_device **list;
+	ssize_t count;
+	ssize_t i;
 
-	if (info->len > info->max_flash_size)
-		errx(EXIT_FAILURE, "Firmware cannot fit in flash");
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0)
+		errx(EXIT_FAILURE, "Can't list the USB devices");
 
-	info->buf = malloc(info->len);
-	if (info->buf == NULL)
-	    errx(EXIT_FAILURE, "Can't allocate %zd bytes for the firmware",
-		 info->len);
+	for (i = 0; i < count && wait->n_present < MAX_PORTS; i++) {
+		if (is_app_device(wait, list[i]))
+			usb_location(list[i], &wait->present[wait->n_present++]);
+	}
 
-	memset(info->buf, 0xff, info->len);
+	libusb_free_device_list(list, 1);
+}
 
-	while (total_read < statbuf.st_size) {
-		off_t remaining = statbuf.st_size - total_read;
-		int ret = read(fd, info->buf + total_read, remaining);
-		if (dev->debug)
-			printf("info->buf %p total_read %lld statbuf.st_size %lld remaining %lld read %d\n ", info->buf, (long long)total_read, (long long)statbuf.st_size, (long long)remaining, ret);
-		if (ret < 0) {
-			err(EXIT_FAILURE, "Can't read firmware file");
+/* Without hotplug, look at the device list every few milliseconds */
+static void poll_app_devices(struct app_wait *wait)
+{
+	libusb_device **list;
+	bool isp_present = false;
+	struct location loc;
+	ssize_t count;
+	ssize_t i;
+
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0)
+		return;
+
+	for (i = 0; i < count; i++) {
+		if (wait->isp_on_usb && is_isp_device(list[i])) {
+			usb_location(list[i], &loc);
+			if (strcmp(loc.name, wait->isp.name) == 0)
+				isp_present = true;
 		}
-		total_read += ret;
+
+		app_event(wait, list[i], true);
 	}
 
-	close(fd);
+	if (wait->isp_on_usb && !isp_present && !wait->left_ms)
+		wait->left_ms = now_ms();
+
+	libusb_free_device_list(list, 1);
 }
 
-/* Encrypt or decrypt some data */
-static void encrypt_or_decrypt(const struct device *dev, struct content *info)
+/* Look for the application for up to timeout_ms */
+static void watch_app_devices(struct app_wait *wait, double timeout_ms)
 {
-	uint8_t *p;
-	int i;
+	struct timeval tv;
 
-	p = info->buf;
-	for (i = 0; i < info->len; i++) {
-		*p++ ^= dev->xor_key[i % XOR_KEY_LEN];
+	if (wait->hotplug) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = ((long)timeout_ms % 1000) * 1000;
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+	} else {
+		poll_app_devices(wait);
+		if (!wait->arrived_ms)
+			usleep(timeout_ms < 10 ? timeout_ms * 1000 : 10000);
 	}
-
-	info->encrypted = !info->encrypted;
 }
 
-/* Create the local key to encrypt the data to send */
-static void create_key(struct device *dev)
+#ifndef WIN32
+/* Watch the devices in a thread from before the reboot, so that the
+ * arrival is timed when it happens, whatever the main thread does */
+static void *app_watch_thread(void *data)
 {
-	uint8_t sum;
-	int i;
+	struct app_wait *wait = data;
 
-	sum = 0;
-	for (i = 0; i < dev->profile->mcu_id_len; i++)
-		sum += dev->id[i];
+	while (!wait->stop && !wait->arrived_ms)
+		watch_app_devices(wait, APP_WATCH_SLICE_MS);
 
-	for (i = 0; i < XOR_KEY_LEN; i++)
-		dev->xor_key[i] = sum;
-	dev->xor_key[7] += dev->profile->type;
+	return NULL;
 }
+#endif
 
-/* Send the encryption key */
-static void send_key(struct device *dev)
+/* Start watching the USB devices, before the reboot, so an early
+ * arrival isn't missed */
+static void arm_app_wait(struct device *dev, struct app_wait *wait)
 {
-	static struct req_set_key req = {
-		.hdr.command = CMD_SET_KEY,
-		.hdr.data_len = 0x1e,
-	};
-	struct resp_set_key resp;
-	int ret;
-	uint8_t sum;
-	int i;
+	if (dev->usb_h) {
+		usb_location(libusb_get_device(dev->usb_h), &wait->isp);
+		wait->isp_on_usb = true;
+	} else {
+		if (wait->vid == 0)
+			errx(EXIT_FAILURE, "The application VID:PID is needed when not flashing over USB");
 
-	sum = 0;
-	for (i = 0; i < XOR_KEY_LEN; i++)
-		sum += dev->xor_key[i];
+		if (libusb_init(NULL))
+			errx(EXIT_FAILURE, "Can't initialize USB");
+	}
 
-	ret = transfer(dev, &req, sizeof(struct req_hdr) + req.hdr.data_len,
-		       &resp, sizeof(resp));
-	if (ret)
-		errx(EXIT_FAILURE, "Can't set the key");
+	snapshot_app_devices(wait);
 
-	if (resp.key_checksum != sum)
-		errx(EXIT_FAILURE, "The device refused the key");
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(NULL,
+					     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					     LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					     LIBUSB_HOTPLUG_NO_FLAGS,
+					     LIBUSB_HOTPLUG_MATCH_ANY,
+					     LIBUSB_HOTPLUG_MATCH_ANY,
+					     LIBUSB_HOTPLUG_MATCH_ANY,
+					     app_hotplug, wait, &wait->cb) == 0)
+		wait->hotplug = true;
+
+#ifndef WIN32
+	if (pthread_create(&wait->thread, NULL, app_watch_thread, wait))
+		errx(EXIT_FAILURE, "Can't start watching the USB devices");
+#endif
 }
 
-/* read or write code flash, or write data flash */
-static int flash_rw(struct device *dev, int cmd, struct content *info,
-		    int *offset_out)
+static bool app_arrived(struct app_wait *wait)
 {
-	struct req_flash_rw req = {
-		.hdr.command = cmd,
-	};
-	struct resp_flash_rw resp;
-	int offset;
-	int to_send;
-	int len;
-	int ret;
-
-	/* Send the firmware in 56 bytes chunks */
-	offset = 0;
-	to_send = info->len;
-	while (to_send) {
-		req.offset = offset;
-
-		len = sizeof(req.data);
-		if (len > to_send)
-			len = to_send;
+	bool arrived;
 
-		req.hdr.data_len = len + 5;
+#ifndef WIN32
+	pthread_mutex_lock(&wait->lock);
+#endif
+	arrived = wait->arrived_ms != 0;
+#ifndef WIN32
+	pthread_mutex_unlock(&wait->lock);
+#endif
 
-		memcpy(&req.data, &info->buf[offset], len);
+	return arrived;
+}
 
-		ret = transfer(dev, &req, sizeof(struct req_hdr) + req.hdr.data_len,
-			       &resp, sizeof(resp));
-		if (ret)
-			errx(EXIT_FAILURE, "Write failure at offset %d", offset);
+/* Wait for the application to enumerate, and report how long it took
+ * from the reboot */
+static void wait_for_app(struct app_wait *wait)
+{
+	double deadline = wait->reboot_ms + wait->deadline_ms;
+	double left;
 
-		if (resp.return_code != 0) {
-			*offset_out = offset;
-			return resp.return_code;
-		}
+	while (!app_arrived(wait)) {
+		left = deadline - now_ms();
+		if (left <= 0)
+			break;
 
-		to_send -= len;
-		offset += len;
+#ifndef WIN32
+		/* The thread is watching */
+		usleep((left < APP_WATCH_SLICE_MS ? left : APP_WATCH_SLICE_MS) * 1000);
+#else
+		watch_app_devices(wait, left);
+#endif
 	}
 
-	if (cmd == CMD_WRITE_CODE_FLASH && dev->profile->need_last_write) {
-		/* The CH32Fx need a last empty write. */
-		req.offset = info->len;
-		req.hdr.data_len = 5;
+#ifndef WIN32
+	wait->stop = 1;
+	pthread_join(wait->thread, NULL);
+#endif
 
-		ret = transfer(dev, &req, sizeof(struct req_hdr) + req.hdr.data_len,
-			       &resp, sizeof(resp));
-		if (ret)
-			errx(EXIT_FAILURE, "Write failure at offset %d", offset);
+	if (wait->hotplug)
+		libusb_hotplug_deregister_callback(NULL, wait->cb);
 
-		if (resp.return_code != 0) {
-			*offset_out = offset;
-			return resp.return_code;
-		}
-	}
+	if (wait->left_ms)
+		printf("Bootloader left after %.0f ms\n",
+		       wait->left_ms - wait->reboot_ms);
 
-	return 0;
+	if (!wait->arrived_ms)
+		errx(EXIT_FAILURE, "The application didn't enumerate within %u ms",
+		     wait->deadline_ms);
+
+	printf("Application %04x:%04x enumerated at %s after %.0f ms\n",
+	       wait->app_vid, wait->app_pid, wait->app.name,
+	       wait->arrived_ms - wait->reboot_ms);
 }
 
-static void write_code_flash(struct device *dev)
+/* Open and claim the USB device at a given location */
+static void open_usb_device_at(struct device *dev, const struct location *loc)
 {
-	int offset;
-	int ret;
+	struct location here;
+	libusb_device **list;
+	ssize_t count;
+	ssize_t i;
 
-	ret = flash_rw(dev, CMD_WRITE_CODE_FLASH, &dev->fw, &offset);
-	if (ret)
-		errx(EXIT_FAILURE, "Write code flash failure at offset %d",
-		     offset);
+	if (libusb_init(NULL))
+		errx(EXIT_FAILURE, "Can't initialize USB");
+
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0)
+		errx(EXIT_FAILURE, "Can't list the USB devices");
+
+	for (i = 0; i < count; i++) {
+		if (!is_isp_device(list[i]))
+			continue;
+
+		usb_location(list[i], &here);
+		if (strcmp(here.name, loc->name) != 0)
+			continue;
+
+		if (libusb_open(list[i], &dev->usb_h))
+			errx(EXIT_FAILURE, "Can't open the USB device");
+		break;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (dev->usb_h == NULL)
+		errx(EXIT_FAILURE, "No device in ISP mode at %s", loc->name);
+
+	claim_usb_device(dev);
 }
 
-static void verify_code_flash(struct device *dev)
+static int cmp_float(const void *a, const void *b)
 {
-	int offset;
-	int ret;
+	float fa = *(const float *)a;
+	float fb = *(const float *)b;
 
-	ret = flash_rw(dev, CMD_CMP_CODE_FLASH, &dev->fw, &offset);
-	if (ret)
-		errx(EXIT_FAILURE, "Check code flash failure at offset %d", offset);
+	return (fa > fb) - (fa < fb);
 }
 
-static void erase_data_flash(struct device *dev)
+/* Round trip percentile of a command, over its last transfers */
+static double rtt_percentile(const struct cmd_stats *st, double pct)
 {
-	struct req_erase_data_flash req = {
-		.hdr.command = CMD_ERASE_DATA_FLASH,
-	};
-	struct resp_erase_data_flash resp;
-	size_t length;
-	int ret;
+	float sorted[RTT_SAMPLES];
+	unsigned int n;
 
-	/* Erase length is in KiB blocks, with a minimum of 1KiB */
-	length = ((dev->profile->data_flash_size + 1023) & ~1023) / 1024;
-	if (length < 1)
-		length = 1;
+	n = st->count < RTT_SAMPLES ? st->count : RTT_SAMPLES;
+	if (n == 0)
+		return 0;
 
-	req.len = length;
+	memcpy(sorted, st->samples, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), cmp_float);
 
-	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
-	if (ret)
-		errx(EXIT_FAILURE, "Can't erase the data flash");
+	return sorted[(unsigned int)(pct / 100 * (n - 1) + 0.5)];
+}
 
-	if (resp.return_code != 0x00)
-		errx(EXIT_FAILURE, "The device refused to erase the data flash");
+static unsigned int rtt_bucket(double ms)
+{
+	double upper = RTT_BUCKET_MIN_MS;
+	unsigned int i = 0;
+
+	while (ms > upper && i < RTT_BUCKETS - 1) {
+		upper *= RTT_BUCKET_RATIO;
+		i++;
+	}
+
+	return i;
 }
 
-static void write_data_flash(struct device *dev)
+static struct cmd_stats *cmd_stats(struct device *dev, uint8_t cmd)
 {
-	int ret;
-	int offset;
+	if (cmd < CMD_CHIP_TYPE || cmd > CMD_READ_DATA_FLASH)
+		return NULL;
 
-	ret = flash_rw(dev, CMD_WRITE_DATA_FLASH, &dev->data, &offset);
-	if (ret)
-		errx(EXIT_FAILURE, "Write data flash failure at offset %d",
-		     offset);
+	return &dev->stats[cmd - CMD_CHIP_TYPE];
 }
 
-static void read_data_flash(struct device *dev)
+/* Account for a completed round trip */
+static void record_rtt(struct device *dev, uint8_t cmd, int out, int in,
+		       double ms)
 {
-	struct req_read_data_flash req = {
-		.hdr.command = CMD_READ_DATA_FLASH,
-	};
-	struct resp_read_data_flash resp;
-	int to_read;
-	int offset;
-	int len;
-	int ret;
+	struct cmd_stats *st = cmd_stats(dev, cmd);
 
-	to_read = dev->data_dump.max_flash_size;
+	if (st == NULL)
+		return;
 
+	if (dev->n_runs && dev->runs[dev->n_runs - 1].cmd == cmd) {
+		dev->runs[dev->n_runs - 1].count++;
+	} else {
+		dev->runs = realloc(dev->runs,
+				    (dev->n_runs + 1) * sizeof(*dev->runs));
+		if (dev->runs == NULL)
+			errx(EXIT_FAILURE, "Can't allocate the command sequence");
+		dev->runs[dev->n_runs++] = (struct cmd_run){ cmd, 1 };
+	}
+
+	st->samples[st->count % RTT_SAMPLES] = ms;
+	st->hist[rtt_bucket(ms)]++;
+	st->count++;
+	st->bytes_out += out;
+	st->bytes_in += in;
+	st->total_ms += ms;
+	if (ms > st->max_ms)
+		st->max_ms = ms;
+
+	/* Sorting on every transfer would be wasteful */
+	if (st->count <= RTT_WARMUP || st->count % 16 == 0)
+		st->p99_ms = rtt_percentile(st, 99);
+}
+
+static void record_error(struct device *dev, uint8_t cmd)
+{
+	struct cmd_stats *st = cmd_stats(dev, cmd);
+
+	if (st)
+		st->errors++;
+}
+
+/* Pick the timeout of a request, according to the policy */
+static unsigned int command_timeout(struct device *dev, const void *req)
+{
+	const struct timeout_policy *tp = &dev->timeouts;
+	const struct req_hdr *hdr = req;
+	struct cmd_stats *st = cmd_stats(dev, hdr->command);
+	unsigned int timeout;
+	unsigned int kib = 0;
+
+	if (!tp->adaptive || st == NULL)
+		return tp->fixed_ms;
+
+	switch (hdr->command) {
+	case CMD_ERASE_CODE_FLASH:
+		kib = ((const struct req_erase_flash *)req)->length;
+		/* fallthrough */
+	case CMD_ERASE_DATA_FLASH:
+		if (hdr->command == CMD_ERASE_DATA_FLASH)
+			kib = ((const struct req_erase_data_flash *)req)->len;
+
+		/* The CH55x / CH54x have a slower flash */
+		timeout = tp->erase_ms_per_kib * kib;
+		if (dev->profile && (dev->profile->family == 0x11 ||
+				     dev->profile->family == 0x12))
+			timeout *= 2;
+		timeout += tp->erase_base_ms;
+		break;
+
+	default:
+		if (st->count < RTT_WARMUP) {
+			timeout = tp->initial_ms;
+		} else {
+			timeout = tp->rtt_factor * st->p99_ms + 1;
+			if (timeout < tp->min_ms)
+				timeout = tp->min_ms;
+		}
+		break;
+	}
+
+	st->timeout_ms = timeout;
+
+	return timeout;
+}
+
+/* Signal asking the sessions to stop, or 0. While a session runs,
+ * SIGINT and SIGTERM only set it, and the session stops before its
+ * next command. */
+static volatile sig_atomic_t stop_signal;
+static volatile sig_atomic_t sessions_running;
+
+#ifndef WIN32
+/* Child processes running the sessions, which the signal is passed
+ * on to */
+static pid_t *session_pids;
+static volatile sig_atomic_t n_session_pids;
+#endif
+
+/* A dry run reads the counters, but doesn't bump them */
+static bool dry_run;
+
+static void stop_handler(int sig)
+{
+#ifndef WIN32
+	int i;
+
+	for (i = 0; i < n_session_pids; i++) {
+		if (session_pids[i] > 0)
+			kill(session_pids[i], sig);
+	}
+#endif
+
+	if (!sessions_running) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+
+	stop_signal = sig;
+}
+
+/* Time the session has been running. On a faulty link, that is the
+ * simulated link time. */
+static double session_elapsed_ms(const struct device *dev)
+{
+	if (dev->faults)
+		return dev->faults->clock_ms;
+
+	return now_ms() - dev->session_start;
+}
+
+/* Why the session must stop before its next command, or NULL */
+static const char *session_stop_reason(const struct device *dev)
+{
+	if (stop_signal == SIGINT)
+		return "interrupted";
+	if (stop_signal == SIGTERM)
+		return "terminated";
+	if (dev->deadline_ms && session_elapsed_ms(dev) >= dev->deadline_ms)
+		return "out of time";
+
+	return NULL;
+}
+
+/* Parse a --timeouts policy */
+static void parse_timeouts(struct timeout_policy *tp, char *spec)
+{
+	char *token;
+	char *value;
+
+	for (token = strtok(spec, ","); token; token = strtok(NULL, ",")) {
+		value = strchr(token, '=');
+		if (value)
+			*value++ = '\0';
+
+		if (strcmp(token, "adaptive") == 0 && !value)
+			tp->adaptive = true;
+		else if (strcmp(token, "fixed") == 0) {
+			tp->adaptive = false;
+			if (value)
+				tp->fixed_ms = strtoul(value, NULL, 0);
+		} else if (!value)
+			errx(EXIT_FAILURE, "Invalid timeout policy '%s'", token);
+		else if (strcmp(token, "factor") == 0)
+			tp->rtt_factor = strtod(value, NULL);
+		else if (strcmp(token, "min") == 0)
+			tp->min_ms = strtoul(value, NULL, 0);
+		else if (strcmp(token, "initial") == 0)
+			tp->initial_ms = strtoul(value, NULL, 0);
+		else if (strcmp(token, "erase-base") == 0)
+			tp->erase_base_ms = strtoul(value, NULL, 0);
+		else if (strcmp(token, "erase-kib") == 0)
+			tp->erase_ms_per_kib = strtoul(value, NULL, 0);
+		else
+			errx(EXIT_FAILURE, "Invalid timeout policy '%s'", token);
+	}
+
+	if (tp->fixed_ms == 0 || tp->initial_ms == 0 || tp->rtt_factor <= 0)
+		errx(EXIT_FAILURE, "Invalid timeout policy");
+}
+
+static void print_stats(struct device *dev)
+{
+	const struct cmd_stats *st;
+	int i;
+
+	printf("Transfer statistics (%s timeouts):\n",
+	       dev->timeouts.adaptive ? "adaptive" : "fixed");
+	printf("  %-13s %6s %6s %8s %8s %8s %8s %8s %8s %8s\n",
+	       "command", "count", "errors", "out B", "in B", "mean ms",
+	       "p50 ms", "p99 ms", "max ms", "tmo ms");
+
+	for (i = 0; i < N_CMDS; i++) {
+		st = &dev->stats[i];
+		if (st->count == 0 && st->errors == 0)
+			continue;
+
+		printf("  %-13s %6u %6u %8llu %8llu %8.3f %8.3f %8.3f %8.3f %8u\n",
+		       cmd_names[i], st->count, st->errors,
+		       st->bytes_out, st->bytes_in,
+		       st->count ? st->total_ms / st->count : 0,
+		       rtt_percentile(st, 50), rtt_percentile(st, 99),
+		       st->max_ms, st->timeout_ms);
+	}
+}
+
+/* Load a per command latency model from the output of --stats. The
+ * mean round trip of each command is used, or -1 when the command
+ * isn't in the table. */
+static void load_latency_model(const char *filename, double *model)
+{
+	char line[256];
+	char name[32];
+	unsigned int count;
+	unsigned int errors;
+	unsigned long long out;
+	unsigned long long in;
+	double mean;
+	int n = 0;
+	FILE *f;
+	int i;
+
+	for (i = 0; i < N_CMDS; i++)
+		model[i] = -1;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't open the latency model '%s'", filename);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%31s %u %u %llu %llu %lf", name, &count,
+			   &errors, &out, &in, &mean) != 6 || count == 0)
+			continue;
+
+		for (i = 0; i < N_CMDS; i++) {
+			if (strcmp(cmd_names[i], name) == 0) {
+				model[i] = mean;
+				n++;
+			}
+		}
+	}
+
+	fclose(f);
+
+	if (n == 0)
+		errx(EXIT_FAILURE, "No transfer statistics in '%s'", filename);
+}
+
+/* Sequence of the commands, like "chip-type read-config write-code*54".
+ * The caller frees it. */
+static char *format_sequence(const struct device *dev)
+{
+	/* A name, a count and a space per run */
+	size_t size = dev->n_runs * 32 + 1;
+	size_t len = 0;
+	char *buf;
+	int i;
+
+	buf = malloc(size);
+	if (buf == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the command sequence");
+
+	buf[0] = '\0';
+	for (i = 0; i < dev->n_runs; i++) {
+		len += snprintf(buf + len, size - len, "%s%s", i ? " " : "",
+				cmd_names[dev->runs[i].cmd - CMD_CHIP_TYPE]);
+		if (dev->runs[i].count > 1)
+			len += snprintf(buf + len, size - len, "*%u",
+					dev->runs[i].count);
+	}
+
+	return buf;
+}
+
+/* Compare the commands and bytes of the session with a budget file,
+ * or save them as the budget if the file doesn't exist yet. Returns
+ * the number of commands over their budget, plus one if the sequence
+ * changed. */
+static int check_budget(const struct device *dev, const char *filename)
+{
+	unsigned int counts[N_CMDS + 1] = { 0 };
+	unsigned long long bytes[N_CMDS + 1] = { 0 };
+	unsigned int budget_counts[N_CMDS + 1] = { 0 };
+	unsigned long long budget_bytes[N_CMDS + 1] = { 0 };
+	char *budget_sequence = NULL;
+	size_t budget_len = 0;
+	bool in_sequence = false;
+	char *sequence;
+	const struct cmd_stats *st;
+	char line[2048];
+	char name[32];
+	char *p;
+	unsigned int count;
+	unsigned long long n_bytes;
+	int over = 0;
+	FILE *f;
+	int i;
+
+	/* The last entry is the total */
+	for (i = 0; i < N_CMDS; i++) {
+		st = &dev->stats[i];
+		counts[i] = st->count + st->errors;
+		bytes[i] = st->bytes_out + st->bytes_in;
+		counts[N_CMDS] += counts[i];
+		bytes[N_CMDS] += bytes[i];
+	}
+	sequence = format_sequence(dev);
+
+	f = fopen(filename, "r");
+	if (f == NULL && errno != ENOENT)
+		err(EXIT_FAILURE, "Can't open the budget");
+
+	if (f == NULL) {
+		f = fopen(filename, "w");
+		if (f == NULL)
+			err(EXIT_FAILURE, "Can't create the budget");
+
+		fprintf(f, "# command count bytes\n");
+		for (i = 0; i <= N_CMDS; i++) {
+			if (counts[i])
+				fprintf(f, "%s %u %llu\n",
+					i < N_CMDS ? cmd_names[i] : "total",
+					counts[i], bytes[i]);
+		}
+		fprintf(f, "sequence %s\n", sequence);
+
+		if (fclose(f))
+			err(EXIT_FAILURE, "Can't write the budget");
+
+		printf("Saved as the budget in %s\n", filename);
+		free(sequence);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		/* The sequence may be longer than a line buffer */
+		if (in_sequence || strncmp(line, "sequence ", 9) == 0) {
+			p = in_sequence ? line : line + 9;
+			in_sequence = strchr(p, '\n') == NULL;
+			p[strcspn(p, "\r\n")] = '\0';
+
+			budget_sequence = realloc(budget_sequence,
+						  budget_len + strlen(p) + 1);
+			if (budget_sequence == NULL)
+				errx(EXIT_FAILURE, "Can't allocate the budget sequence");
+			strcpy(budget_sequence + budget_len, p);
+			budget_len += strlen(p);
+			continue;
+		}
+
+		if (line[0] == '#' ||
+		    sscanf(line, "%31s %u %llu", name, &count, &n_bytes) != 3)
+			continue;
+
+		for (i = 0; i < N_CMDS; i++) {
+			if (strcmp(cmd_names[i], name) == 0)
+				break;
+		}
+		if (i == N_CMDS && strcmp(name, "total") != 0)
+			errx(EXIT_FAILURE, "Unknown command '%s' in the budget", name);
+
+		budget_counts[i] = count;
+		budget_bytes[i] = n_bytes;
+	}
+
+	fclose(f);
+
+	printf("Command budget:\n");
+	printf("  %-13s %6s %6s %10s %10s\n", "command", "count", "budget",
+	       "bytes", "budget");
+
+	for (i = 0; i <= N_CMDS; i++) {
+		if (counts[i] == 0 && budget_counts[i] == 0)
+			continue;
+
+		printf("  %-13s %6u %6u %10llu %10llu", i < N_CMDS ?
+		       cmd_names[i] : "total", counts[i], budget_counts[i],
+		       bytes[i], budget_bytes[i]);
+
+		if (counts[i] > budget_counts[i] || bytes[i] > budget_bytes[i]) {
+			printf("  OVER\n");
+			over++;
+		} else {
+			printf("\n");
+		}
+	}
+
+	if (strcmp(sequence, budget_sequence ? budget_sequence : "") != 0) {
+		printf("Sequence changed:\n  budget %s\n  now    %s\n",
+		       budget_sequence ? budget_sequence : "", sequence);
+		over++;
+	}
+
+	free(budget_sequence);
+	free(sequence);
+
+	return over;
+}
+
+/* Print what the session sent to the emulated chip, and how long it
+ * would take according to the latency model, if any */
+static void print_estimate(struct device *dev, const double *model)
+{
+	const struct cmd_stats *st;
+	unsigned long long out = 0;
+	unsigned long long in = 0;
+	unsigned int count = 0;
+	bool unknown = false;
+	double total = 0;
+	int i;
+
+	printf("Dry run on %s, bootloader %d.%d.%d:\n", dev->profile->name,
+	       (dev->bv >> 16) & 0xff, (dev->bv >> 8) & 0xff, dev->bv & 0xff);
+	printf("  %-13s %6s %8s %8s %10s\n",
+	       "command", "count", "out B", "in B", "est ms");
+
+	for (i = 0; i < N_CMDS; i++) {
+		st = &dev->stats[i];
+		if (st->count == 0)
+			continue;
+
+		printf("  %-13s %6u %8llu %8llu ", cmd_names[i], st->count,
+		       st->bytes_out, st->bytes_in);
+		if (model && model[i] >= 0) {
+			printf("%10.1f\n", st->count * model[i]);
+			total += st->count * model[i];
+		} else {
+			printf("%10s\n", "?");
+			unknown = true;
+		}
+
+		count += st->count;
+		out += st->bytes_out;
+		in += st->bytes_in;
+	}
+
+	printf("  %-13s %6u %8llu %8llu ", "total", count, out, in);
+	if (model)
+		printf("%10.1f%s\n", total, unknown ? "+" : "");
+	else
+		printf("%10s\n", "?");
+}
+
+#ifdef __linux__
+/* Parse the real time mode, as [fifo|rr][,prio=N][,cpus=LIST] where
+ * LIST is made of CPUs and ranges separated with '+', like 2-5+7 */
+static void parse_realtime(struct realtime *rt, const char *arg)
+{
+	char *args = strdup(arg);
+	char *tok;
+	char *p;
+	long first;
+	long last;
+
+	if (args == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the real time mode");
+
+	for (tok = strtok(args, ","); tok; tok = strtok(NULL, ",")) {
+		if (strcmp(tok, "fifo") == 0) {
+			rt->policy = SCHED_FIFO;
+		} else if (strcmp(tok, "rr") == 0) {
+			rt->policy = SCHED_RR;
+		} else if (strncmp(tok, "prio=", 5) == 0) {
+			rt->priority = strtol(tok + 5, &p, 0);
+			if (*p || rt->priority < sched_get_priority_min(rt->policy) ||
+			    rt->priority > sched_get_priority_max(rt->policy))
+				errx(EXIT_FAILURE, "Invalid real time priority %s", tok + 5);
+		} else if (strncmp(tok, "cpus=", 5) == 0) {
+			p = tok + 5;
+			do {
+				first = last = strtol(p, &p, 10);
+				if (*p == '-')
+					last = strtol(p + 1, &p, 10);
+				if ((*p && *p != '+') || first < 0 ||
+				    last < first || last >= CPU_SETSIZE)
+					errx(EXIT_FAILURE, "Invalid CPU list %s", tok + 5);
+
+				while (first <= last)
+					CPU_SET(first++, &rt->cpus);
+			} while (*p++ == '+');
+		} else {
+			errx(EXIT_FAILURE, "Invalid real time mode %s", tok);
+		}
+	}
+
+	free(args);
+}
+
+/* Touch a good chunk of stack, so it is faulted in and locked before
+ * the transfers start */
+static void prefault_stack(void)
+{
+	volatile char stack[256 * 1024];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/* Lock the memory, and run on the chosen CPUs with a real time
+ * policy. A gang session runs on its own CPU, picked among the chosen
+ * ones. Called once all the buffers are loaded, which mlockall faults
+ * in. */
+static void enter_realtime(struct device *dev, const struct realtime *rt)
+{
+	struct sched_param param = { .sched_priority = rt->priority };
+	cpu_set_t cpus = rt->cpus;
+	int n;
+	int i;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		err(EXIT_FAILURE, "Can't lock the memory (see ulimit -l)");
+
+	prefault_stack();
+
+	if (CPU_COUNT(&cpus) == 0 &&
+	    sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+		err(EXIT_FAILURE, "Can't get the CPU affinity");
+
+	if (dev->gang) {
+		n = dev->gang_member % CPU_COUNT(&cpus);
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &cpus) && n-- == 0)
+				break;
+		}
+
+		CPU_ZERO(&cpus);
+		CPU_SET(i, &cpus);
+		printf("Running on CPU %d\n", i);
+	}
+
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+		err(EXIT_FAILURE, "Can't set the CPU affinity");
+
+	if (sched_setscheduler(0, rt->policy, &param) == -1)
+		err(EXIT_FAILURE, "Can't use a real time policy (needs CAP_SYS_NICE or an rtprio limit)");
+}
+
+/* Round trip percentile of a command, over the whole session. This is
+ * the upper bound of a histogram bucket, so within 12%. */
+static double rtt_session_percentile(const struct cmd_stats *st,
+				     double pct)
+{
+	unsigned long long rank;
+	unsigned long long seen = 0;
+	double upper = RTT_BUCKET_MIN_MS;
+	unsigned int i;
+
+	if (st->count == 0)
+		return 0;
+
+	rank = (unsigned long long)(pct / 100 * (st->count - 1) + 0.5);
+
+	for (i = 0; i < RTT_BUCKETS - 1; i++) {
+		seen += st->hist[i];
+		if (seen > rank)
+			break;
+		upper *= RTT_BUCKET_RATIO;
+	}
+
+	return upper < st->max_ms ? upper : st->max_ms;
+}
+
+/* Round trip percentiles of the commands sent many times, over the
+ * whole session */
+static void print_latency(struct device *dev)
+{
+	const struct cmd_stats *st;
+	int i;
+
+	printf("Transfer latency:\n");
+	printf("  %-13s %8s %8s %8s %8s %8s\n",
+	       "command", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+
+	for (i = 0; i < N_CMDS; i++) {
+		st = &dev->stats[i];
+		if (st->count < 16)
+			continue;
+
+		printf("  %-13s %8.3f %8.3f %8.3f %8.3f %8.3f\n", cmd_names[i],
+		       rtt_session_percentile(st, 50),
+		       rtt_session_percentile(st, 90),
+		       rtt_session_percentile(st, 99),
+		       rtt_session_percentile(st, 99.9), st->max_ms);
+	}
+}
+#endif
+
+/* Answer a request like the bootloader would. Returns 0, or
+ * -ETIMEDOUT if the bootloader wouldn't answer. */
+static int emulate(struct emulator *emu, const void *req, void *resp,
+		   int resp_len)
+{
+	const struct req_hdr *hdr = req;
+	struct resp_hdr *rhdr = resp;
+	uint16_t *return_code = (uint16_t *)(rhdr + 1);
+	uint8_t last_cmd = emu->last_cmd;
+	size_t offset;
+	size_t len;
+	size_t i;
+
+	memset(resp, 0, resp_len);
+	rhdr->command = hdr->command;
+	rhdr->data_len = resp_len - sizeof(*rhdr);
+	emu->last_cmd = hdr->command;
+
+	switch (hdr->command) {
+	case CMD_CHIP_TYPE: {
+		struct resp_chip_type *r = resp;
+
+		r->type = emu->profile->type;
+		r->family = emu->profile->family;
+		break;
+	}
+
+	case CMD_READ_CONFIG: {
+		struct resp_read_config *r = resp;
+
+		r->what = ((const struct req_read_config *)req)->what;
+		memcpy(r->config_data, emu->config, sizeof(r->config_data));
+		r->bootloader_version = htobe32(emu->rules->version);
+		memcpy(r->id, emu->id, sizeof(r->id));
+		r->id_checksum = emu->id[sizeof(r->id)];
+		break;
+	}
+
+	case CMD_WRITE_CONFIG:
+		memcpy(emu->config,
+		       ((const struct req_write_config *)req)->config_data,
+		       sizeof(emu->config));
+		break;
+
+	case CMD_SET_KEY: {
+		struct resp_set_key *r = resp;
+		uint8_t sum = 0;
+
+		for (i = 0; i < emu->profile->mcu_id_len; i++)
+			sum += emu->id[i];
+
+		memset(emu->key, sum, XOR_KEY_LEN);
+		emu->key[7] += emu->profile->type;
+		emu->key_set = true;
+
+		for (i = 0; i < XOR_KEY_LEN; i++)
+			r->key_checksum += emu->key[i];
+		r->key_checksum &= 0xff;
+		break;
+	}
+
+	case CMD_ERASE_CODE_FLASH:
+		len = ((const struct req_erase_flash *)req)->length * 1024;
+		if (len > emu->profile->code_flash_size)
+			len = emu->profile->code_flash_size;
+		memset(emu->code, 0xff, len);
+		break;
+
+	case CMD_WRITE_CODE_FLASH:
+	case CMD_CMP_CODE_FLASH:
+	case CMD_WRITE_DATA_FLASH: {
+		const struct req_flash_rw *r = req;
+		size_t size = hdr->command == CMD_WRITE_DATA_FLASH ?
+			emu->profile->data_flash_size :
+			emu->profile->code_flash_size;
+		uint8_t *flash = hdr->command == CMD_WRITE_DATA_FLASH ?
+			emu->data : emu->code;
+		bool mismatch = false;
+		uint8_t byte;
+
+		/* Going from writing to comparing needs the key again */
+		if (hdr->command == CMD_CMP_CODE_FLASH &&
+		    last_cmd == CMD_WRITE_CODE_FLASH)
+			emu->key_set = false;
+
+		offset = r->offset;
+		len = hdr->data_len - 5;
+		if (!emu->key_set || offset + len > size) {
+			*return_code = 0xfe;
+			break;
+		}
+
+		for (i = 0; i < len; i++) {
+			byte = r->data[i] ^ emu->key[(offset + i) % XOR_KEY_LEN];
+
+			if (hdr->command != CMD_CMP_CODE_FLASH)
+				flash[offset + i] = byte;
+			else if (flash[offset + i] != byte)
+				mismatch = true;
+		}
+
+		/* Some bootloaders fail all the compares after one failed */
+		if (mismatch && emu->rules->sticky_cmp_failure)
+			emu->cmp_failed = true;
+
+		if (mismatch || emu->cmp_failed)
+			*return_code = 0xfe;
+		break;
+	}
+
+	case CMD_ERASE_DATA_FLASH:
+		memset(emu->data, 0xff, emu->profile->data_flash_size);
+		break;
+
+	case CMD_READ_DATA_FLASH: {
+		const struct req_read_data_flash *r = req;
+		struct resp_read_data_flash *rr = resp;
+
+		offset = r->offset;
+		len = r->len;
+		if (len > sizeof(rr->data) ||
+		    offset + len > emu->profile->data_flash_size)
+			rr->return_code = 0xfe;
+		else
+			memcpy(rr->data, &emu->data[offset], len);
+		break;
+	}
+
+	case CMD_REBOOT:
+		emu->key_set = false;
+		emu->cmp_failed = false;
+
+		/* Older bootloaders reboot without answering */
+		if (!emu->rules->wait_reboot_resp)
+			return -ETIMEDOUT;
+		break;
+
+	default:
+		*return_code = 0xff;
+		break;
+	}
+
+	return 0;
+}
+
+/* Queue bytes sent by the emulated chip, until the host reads them.
+ * What doesn't fit is lost, as in a full receive buffer. */
+static void emulate_send(struct emulator *emu, const void *buf, int len)
+{
+	if (len > (int)sizeof(emu->rx) - emu->rx_len)
+		len = sizeof(emu->rx) - emu->rx_len;
+
+	memcpy(&emu->rx[emu->rx_len], buf, len);
+	emu->rx_len += len;
+}
+
+/* Read up to len bytes sent by the emulated chip. Returns the number
+ * of bytes read. */
+static int emulate_recv(struct emulator *emu, void *buf, int len)
+{
+	if (len > emu->rx_len)
+		len = emu->rx_len;
+
+	memcpy(buf, emu->rx, len);
+	emu->rx_len -= len;
+	memmove(emu->rx, &emu->rx[len], emu->rx_len);
+
+	return len;
+}
+
+#ifndef WIN32
+/* The emulated chip receives a serial frame, and answers with one, so
+ * that a dry run covers the framing too */
+static void emulate_serial(struct emulator *emu, const uint8_t *frame,
+			   int frame_len, int resp_len)
+{
+	uint8_t resp_frame[128];
+
+	if (resp_len + 3 > (int)sizeof(resp_frame))
+		errx(EXIT_FAILURE, "Response too large for a serial frame");
+
+	/* The bootloader drops a bad frame */
+	if (frame_len < (int)sizeof(struct req_hdr) + 3 ||
+	    frame[0] != SERIAL_REQ_MAGIC1 || frame[1] != SERIAL_REQ_MAGIC2 ||
+	    frame[frame_len - 1] != serial_crc(&frame[2], frame_len - 3))
+		return;
+
+	if (emulate(emu, &frame[2], &resp_frame[2], resp_len))
+		return;
+
+	resp_frame[0] = SERIAL_RESP_MAGIC1;
+	resp_frame[1] = SERIAL_RESP_MAGIC2;
+	resp_frame[2 + resp_len] = serial_crc(&resp_frame[2], resp_len);
+
+	emulate_send(emu, resp_frame, resp_len + 3);
+}
+#endif
+
+/* Hand what the host sent, a USB packet or a serial frame, to the
+ * emulated chip. Its response waits on the link. Returns the number
+ * of bytes sent back. */
+static int emulate_link(struct emulator *emu, const void *req, int req_len,
+			int resp_len)
+{
+	uint8_t resp[128];
+	int queued = emu->rx_len;
+
+#ifndef WIN32
+	if (emu->serial) {
+		emulate_serial(emu, req, req_len, resp_len);
+		return emu->rx_len - queued;
+	}
+#endif
+
+	if (resp_len > (int)sizeof(resp))
+		errx(EXIT_FAILURE, "Response too large for a packet");
+
+	if (emulate(emu, req, resp, resp_len) == 0)
+		emulate_send(emu, resp, resp_len);
+
+	return emu->rx_len - queued;
+}
+
+/* Random number in [0, 1), reproducible from the seed */
+static double link_random(struct link_faults *lf)
+{
+	/* xorshift64* */
+	lf->rng ^= lf->rng >> 12;
+	lf->rng ^= lf->rng << 25;
+	lf->rng ^= lf->rng >> 27;
+
+	return ((lf->rng * 2685821657736338717ull) >> 11) * (1.0 / (1ull << 53));
+}
+
+static bool link_fault(struct link_faults *lf, double probability)
+{
+	return probability > 0 && link_random(lf) < probability;
+}
+
+/* Parse a fault probability, as a fraction or a percentage */
+static double parse_probability(const char *value)
+{
+	char *end;
+	double p;
+
+	p = strtod(value, &end);
+	if (*end == '%') {
+		p /= 100;
+		end++;
+	}
+
+	if (*end || p < 0 || p > 1)
+		errx(EXIT_FAILURE, "Invalid probability '%s'", value);
+
+	return p;
+}
+
+static void parse_faults(struct link_faults *lf, char *spec)
+{
+	char *token;
+	char *value;
+
+	memset(lf, 0, sizeof(*lf));
+	lf->rng = 0x9e3779b97f4a7c15ull;
+	lf->latency_ms = 1;
+	lf->stall_ms = 2000;
+
+	for (token = strtok(spec, ","); token; token = strtok(NULL, ",")) {
+		value = strchr(token, '=');
+		if (value == NULL)
+			errx(EXIT_FAILURE, "Invalid link fault '%s'", token);
+		*value++ = '\0';
+
+		if (strcmp(token, "seed") == 0)
+			/* Spread the small seeds over the state */
+			lf->rng = (strtoull(value, NULL, 0) + 1) *
+				0x9e3779b97f4a7c15ull;
+		else if (strcmp(token, "latency") == 0)
+			lf->latency_ms = strtod(value, NULL);
+		else if (strcmp(token, "jitter") == 0)
+			lf->jitter_ms = strtod(value, NULL);
+		else if (strcmp(token, "dist") == 0 && strcmp(value, "normal") == 0)
+			lf->normal = true;
+		else if (strcmp(token, "dist") == 0 && strcmp(value, "uniform") == 0)
+			lf->normal = false;
+		else if (strcmp(token, "drop") == 0)
+			lf->drop = parse_probability(value);
+		else if (strcmp(token, "truncate") == 0)
+			lf->truncate = parse_probability(value);
+		else if (strcmp(token, "corrupt") == 0)
+			lf->corrupt = parse_probability(value);
+		else if (strcmp(token, "stall") == 0)
+			lf->stall = parse_probability(value);
+		else if (strcmp(token, "stall-ms") == 0)
+			lf->stall_ms = strtod(value, NULL);
+		else
+			errx(EXIT_FAILURE, "Invalid link fault '%s'", token);
+	}
+}
+
+/* Send a request through the faulty link. The chip sees it, but its
+ * response can be dropped, cut short or corrupted on the way, or come
+ * too late, and the host finds out reading it. A short response leaves
+ * the reader waiting until the timeout. */
+static int faulty_transfer(struct device *dev, const void *req, int req_len,
+			   int resp_len, unsigned int timeout, double *ms)
+{
+	struct link_faults *lf = dev->faults;
+	struct emulator *emu = dev->emu;
+	double latency;
+	double jitter;
+	bool whole;
+	int ret = 0;
+	int sent;
+	int i;
+
+	lf->transfers++;
+
+	/* Irwin-Hall sum of uniforms, as an approximate normal */
+	if (lf->normal) {
+		jitter = -6;
+		for (i = 0; i < 12; i++)
+			jitter += link_random(lf);
+		jitter *= lf->jitter_ms / 3;
+	} else {
+		jitter = (link_random(lf) * 2 - 1) * lf->jitter_ms;
+	}
+
+	latency = lf->latency_ms + jitter;
+	if (latency < 0)
+		latency = 0;
+
+	if (link_fault(lf, lf->stall)) {
+		lf->stalled++;
+		latency += lf->stall_ms;
+	}
+
+	sent = emulate_link(emu, req, req_len, resp_len);
+	whole = sent > 0;
+
+	if (sent && link_fault(lf, lf->drop)) {
+		lf->dropped++;
+		emu->rx_len -= sent;
+		whole = false;
+	} else if (sent && link_fault(lf, lf->truncate)) {
+		lf->truncated++;
+		emu->rx_len -= sent - (int)(link_random(lf) * sent);
+		whole = false;
+	} else if (sent && link_fault(lf, lf->corrupt)) {
+		lf->corrupted++;
+		emu->rx[emu->rx_len - sent + (int)(link_random(lf) * sent)] ^= 0xff;
+	}
+
+	/* Too late, the response stays on the link until drained */
+	if (whole && latency > timeout)
+		ret = -ETIMEDOUT;
+
+	if (!whole || latency > timeout)
+		latency = timeout;
+
+	lf->clock_ms += latency;
+	*ms = latency;
+
+	return ret;
+}
+
+static void print_faults(const struct device *dev, bool ok)
+{
+	const struct link_faults *lf = dev->faults;
+
+	printf("Faulty link: %u transfers, %u dropped, %u truncated, %u corrupted, %u stalled, %u retried\n",
+	       lf->transfers, lf->dropped, lf->truncated, lf->corrupted,
+	       lf->stalled, lf->retried);
+
+	/* Only the emulated link has a simulated time */
+	if (dev->emu == NULL)
+		return;
+
+	printf("Session %s after %.1f ms of link time", ok ? "succeeded" : "failed",
+	       lf->clock_ms);
+	if (!ok && dev->step >= 0)
+		printf(", in %s", step_names[dev->step]);
+	printf("\n");
+}
+
+#ifdef __linux__
+/* Give back what the dead sessions of a group held: their slots, and
+ * their place in the queue, which would block the smaller jobs. */
+static void gang_repair(struct gang *gang, int group)
+{
+	struct gang_group *g = &gang->groups[group];
+	struct gang_member *m;
+	int ret;
+	int i;
+
+	for (i = 0; i < gang->n_members; i++) {
+		m = &gang->members[i];
+		if (m->group != group)
+			continue;
+
+		ret = pthread_mutex_trylock(&m->alive);
+		if (ret == EBUSY)
+			continue;
+
+		if (ret == EOWNERDEAD) {
+			m->waiting = false;
+			g->in_flight -= m->slots;
+			m->slots = 0;
+			pthread_mutex_consistent(&m->alive);
+		}
+		pthread_mutex_unlock(&m->alive);
+	}
+}
+
+static void gang_lock(struct gang *gang, int group)
+{
+	struct gang_group *g = &gang->groups[group];
+
+	/* A session dying with the lock held must not hang the others */
+	if (pthread_mutex_lock(&g->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&g->lock);
+		gang_repair(gang, group);
+	}
+}
+
+/* Whether a session with a larger job waits for a slot of the same
+ * group. The longest jobs go first, so the gang finishes sooner. */
+static bool gang_larger_waiting(const struct gang *gang, int member)
+{
+	const struct gang_member *m = &gang->members[member];
+	int i;
+
+	for (i = 0; i < gang->n_members; i++) {
+		const struct gang_member *o = &gang->members[i];
+
+		if (i != member && o->waiting && o->group == m->group &&
+		    o->job_size > m->job_size)
+			return true;
+	}
+
+	return false;
+}
+
+/* Wait for a transfer slot in the TT group of the device. Returns
+ * false, without a slot, if the session must stop first. */
+static bool gang_acquire(struct device *dev)
+{
+	struct gang_member *m = &dev->gang->members[dev->gang_member];
+	struct gang_group *g = &dev->gang->groups[m->group];
+	struct timespec until;
+	bool stop = false;
+
+	gang_lock(dev->gang, m->group);
+
+	m->waiting = true;
+	while (g->in_flight >= g->limit ||
+	       gang_larger_waiting(dev->gang, dev->gang_member)) {
+		/* Wake up now and then, to see a signal or the deadline */
+		if (session_stop_reason(dev)) {
+			stop = true;
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &until);
+		until.tv_nsec += GANG_WAIT_SLICE_MS * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&g->cond, &g->lock, &until) ==
+		    EOWNERDEAD)
+			pthread_mutex_consistent(&g->lock);
+
+		/* A session may have died while not holding the lock */
+		gang_repair(dev->gang, m->group);
+	}
+	m->waiting = false;
+
+	if (!stop) {
+		g->in_flight++;
+		m->slots++;
+	}
+
+	pthread_mutex_unlock(&g->lock);
+
+	/* A larger job may have been waiting behind this one */
+	if (stop)
+		pthread_cond_broadcast(&g->cond);
+
+	return !stop;
+}
+
+/* Change the limit of the group in the same direction as long as the
+ * throughput improves, and turn back when it drops. */
+static void gang_tune(struct gang_group *g)
+{
+	double now = now_ms();
+	double rate;
+
+	if (now <= g->window_ms)
+		return;
+
+	rate = g->bytes / (now - g->window_ms);
+
+	if (g->last_rate && rate < g->last_rate)
+		g->direction = -g->direction;
+
+	g->limit += g->direction;
+	if (g->limit < 1 || g->limit > g->members) {
+		/* End of the range, try the other way next time */
+		g->direction = -g->direction;
+		g->limit = g->limit < 1 ? 1 : g->members;
+	}
+
+	if (g->limit < g->min_limit)
+		g->min_limit = g->limit;
+	if (g->limit > g->max_limit)
+		g->max_limit = g->limit;
+
+	g->last_rate = rate;
+	g->transfers = 0;
+	g->bytes = 0;
+	g->window_ms = now;
+}
+
+/* Give the transfer slot back */
+static void gang_release(struct device *dev, int bytes)
+{
+	struct gang_member *m = &dev->gang->members[dev->gang_member];
+	struct gang_group *g = &dev->gang->groups[m->group];
+
+	gang_lock(dev->gang, m->group);
+
+	g->in_flight--;
+	m->slots--;
+	g->bytes += bytes;
+	if (++g->transfers >= GANG_TUNE_TRANSFERS)
+		gang_tune(g);
+
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
+
+/* Once identified, a session tells the size of its job */
+static void gang_set_job(struct device *dev)
+{
+	struct gang_member *m = &dev->gang->members[dev->gang_member];
+	struct gang_group *g = &dev->gang->groups[m->group];
+
+	gang_lock(dev->gang, m->group);
+	m->job_size = dev->profile->code_flash_size;
+	pthread_mutex_unlock(&g->lock);
+}
+#endif
+
+/* Send a request to the emulated chip, through the faulty link if
+ * there is one. The response is then read from the link. */
+static int emulate_request(struct device *dev, const void *req,
+			   int req_len, int resp_len, unsigned int timeout,
+			   double *ms)
+{
+	if (dev->faults)
+		return faulty_transfer(dev, req, req_len, resp_len, timeout,
+				       ms);
+
+	emulate_link(dev->emu, req, req_len, resp_len);
+
+	return 0;
+}
+
+#ifndef WIN32
+/* Read len bytes from the serial port, or from the emulated serial
+ * link, where the missing bytes would never come before the deadline */
+static int link_read(struct device *dev, void *buf, int len,
+		     double deadline)
+{
+	if (dev->emu)
+		return emulate_recv(dev->emu, buf, len) == len ? 0 : -ETIMEDOUT;
+
+	return serial_read(dev->fd, buf, len, deadline);
+}
+#endif
+
+/* Send a request, get a reply */
+static int transfer_once(struct device *dev, void *req, int req_len,
+			 void *resp, int resp_len)
+{
+	uint8_t cmd = ((struct req_hdr *)req)->command;
+	unsigned int timeout = command_timeout(dev, req);
+	double start = now_ms();
+	double link_ms = 0;
+	int len;
+	int ret;
+#ifndef WIN32
+	uint8_t frame[sizeof(struct req_flash_rw) + 3];
+	int frame_len;
+	unsigned char resp_serial_prefix[2];
+	unsigned char resp_serial_crc[1];
+	double deadline = start + timeout;
+#endif
+#ifdef __linux__
+	bool gang;
+#endif
+
+	if (dev->emu && !dev->emu->serial) {
+		if (dev->debug)
+			hexdump("request", req, req_len);
+
+		ret = emulate_request(dev, req, req_len, resp_len, timeout,
+				      &link_ms);
+		if (ret)
+			goto fail;
+
+		len = emulate_recv(dev->emu, resp, resp_len);
+		if (len == 0) {
+			ret = -ETIMEDOUT;
+			goto fail;
+		}
+
+		if (dev->debug)
+			hexdump("response", resp, len);
+#ifndef WIN32
+	} else if (dev->fd || dev->emu) {
+		/* Serial port case, or the emulated chip behind one. The
+		 * whole frame goes in a single write, so the adapter
+		 * sends it in one go. */
+		frame_len = serial_frame(frame, req, req_len);
+		if (dev->emu) {
+			ret = emulate_request(dev, frame, frame_len, resp_len,
+					      timeout, &link_ms);
+			if (ret)
+				goto fail;
+		} else if (write(dev->fd, frame, frame_len) != frame_len) {
+			errx(EXIT_FAILURE, "Serial port write error");
+		}
+
+		if (dev->debug)
+			hexdump("request", req, req_len);
+
+		ret = link_read(dev, resp_serial_prefix, sizeof(resp_serial_prefix), deadline);
+		if (ret == 0 && (resp_serial_prefix[0] != SERIAL_RESP_MAGIC1 || resp_serial_prefix[1] != SERIAL_RESP_MAGIC2))
+			ret = -EIO;
+		if (ret) {
+			if (dev->debug)
+				printf("Serial port response magic read error\n");
+			goto fail;
+		}
+
+		ret = link_read(dev, resp, resp_len, deadline);
+		if (ret) {
+			if (dev->debug)
+				printf("Serial port response read error\n");
+			goto fail;
+		}
+
+		ret = link_read(dev, resp_serial_crc, sizeof(resp_serial_crc), deadline);
+		if (ret == 0 && resp_serial_crc[0] != serial_crc(resp, resp_len))
+			ret = -EIO;
+		if (ret) {
+			if (dev->debug)
+				printf("Serial port response crc read error\n");
+			goto fail;
+		}
+
+		if (dev->debug)
+			hexdump("response", resp, resp_len);
+
+		len = resp_len;
+#endif
+	} else {
+		/* USB case */
+#ifdef __linux__
+		/* The erase commands barely use the bus, but keep the
+		 * device busy for long. They don't take a slot. */
+		gang = dev->gang && cmd != CMD_ERASE_CODE_FLASH &&
+			cmd != CMD_ERASE_DATA_FLASH;
+		if (gang) {
+			/* Not sent, the session stops instead */
+			if (!gang_acquire(dev))
+				return -ECANCELED;
+			start = now_ms();
+		}
+#endif
+		ret = libusb_bulk_transfer(dev->usb_h, EP_OUT, req, req_len,
+				   &len, timeout);
+		if (ret == 0) {
+			if (dev->debug)
+				hexdump("request", req, len);
+
+			ret = libusb_bulk_transfer(dev->usb_h, EP_IN, resp,
+						   resp_len, &len, timeout);
+		}
+#ifdef __linux__
+		if (gang)
+			gang_release(dev, ret ? 0 : req_len + len);
+#endif
+		if (ret)
+			goto usb_fail;
+
+		if (dev->debug)
+			hexdump("response", resp, len);
+	}
+
+	/* A late response to an earlier command, or a garbled one */
+	if (len < (int)sizeof(struct resp_hdr) ||
+	    ((struct resp_hdr *)resp)->command != cmd) {
+		if (dev->debug)
+			printf("Response doesn't match command 0x%02x\n", cmd);
+		ret = -EIO;
+		goto fail;
+	}
+
+	record_rtt(dev, cmd, req_len, len,
+		   dev->faults ? link_ms : now_ms() - start);
+
+	return 0;
+
+usb_fail:
+	ret = ret == LIBUSB_ERROR_TIMEOUT ? -ETIMEDOUT : -EIO;
+fail:
+	record_error(dev, cmd);
+
+	if (dev->debug)
+		printf("Transfer of command 0x%02x failed after %.1f ms (timeout %u ms)\n",
+		       cmd, now_ms() - start, timeout);
+
+	return ret;
+}
+
+/* Drop what is left of a late or partial response, until the link is
+ * quiet, so that it isn't taken for the response to the next request */
+static void drain_input(struct device *dev)
+{
+	uint8_t buf[64];
+	int len;
+#ifndef WIN32
+	struct pollfd pfd = {
+		.fd = dev->fd,
+		.events = POLLIN,
+	};
+#endif
+
+	if (dev->emu) {
+		dev->emu->rx_len = 0;
+		return;
+	}
+
+#ifndef WIN32
+	if (dev->fd) {
+		while (poll(&pfd, 1, DRAIN_QUIET_MS) > 0 &&
+		       read(dev->fd, buf, sizeof(buf)) > 0)
+			;
+		return;
+	}
+#endif
+
+	while (libusb_bulk_transfer(dev->usb_h, EP_IN, buf, sizeof(buf), &len,
+				    DRAIN_QUIET_MS) == 0)
+		;
+}
+
+/* Whether a command can be sent again when its response was lost.
+ * A write may have reached the flash before its response was lost,
+ * and a reboot is gone, so these are never repeated. */
+static bool command_is_idempotent(uint8_t cmd)
+{
+	switch (cmd) {
+	case CMD_CHIP_TYPE:
+	case CMD_SET_KEY:
+	case CMD_ERASE_CODE_FLASH:
+	case CMD_CMP_CODE_FLASH:
+	case CMD_READ_CONFIG:
+	case CMD_WRITE_CONFIG:
+	case CMD_ERASE_DATA_FLASH:
+	case CMD_READ_DATA_FLASH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Stop the session between two commands, if it was interrupted or
+ * is out of time. Nothing more is sent, and the reboot is skipped, so
+ * the bootloader is ready for a new session, which starts over. */
+static void check_session_stop(struct device *dev, const void *req,
+			       bool sent)
+{
+	const struct req_flash_rw *rw = req;
+	const char *reason = session_stop_reason(dev);
+	uint8_t cmd = rw->hdr.command;
+
+	if (reason == NULL)
+		return;
+
+	printf("Session %s after %.1f ms", reason, session_elapsed_ms(dev));
+	if (dev->step >= 0)
+		printf(", in %s", step_names[dev->step]);
+	printf(", %s %s", sent ? "no response to" : "before",
+	       cmd_names[cmd - CMD_CHIP_TYPE]);
+	if (cmd == CMD_WRITE_CODE_FLASH || cmd == CMD_CMP_CODE_FLASH ||
+	    cmd == CMD_WRITE_DATA_FLASH || cmd == CMD_READ_DATA_FLASH)
+		printf(" at offset 0x%x", rw->offset);
+	printf("\n");
+
+	errx(EXIT_FAILURE, "Session stopped, the bootloader is ready for a new one");
+}
+
+/* Send a request, get a reply, trying again on a lost or damaged
+ * response when that is safe. */
+static int transfer(struct device *dev, void *req, int req_len,
+		    void *resp, int resp_len)
+{
+	uint8_t cmd = ((struct req_hdr *)req)->command;
+	int tries = command_is_idempotent(cmd) ? dev->retries : 0;
+	int ret;
+
+	while (1) {
+		check_session_stop(dev, req, false);
+
+		ret = transfer_once(dev, req, req_len, resp, resp_len);
+		if (ret == 0)
+			return 0;
+
+		check_session_stop(dev, req, ret != -ECANCELED);
+		if (tries-- == 0)
+			return ret;
+
+		if (dev->debug)
+			printf("Retrying command 0x%02x\n", cmd);
+		if (dev->faults)
+			dev->faults->retried++;
+		drain_input(dev);
+	}
+}
+
+static const struct ch_profile *find_profile(uint8_t family, uint8_t type)
+{
+	const struct ch_profile *profile = profiles;
+
+	while (profile->name) {
+		if (profile->family == family && profile->type == type)
+			return profile;
+
+		profile++;
+	}
+
+	return NULL;
+}
+
+/* Largest flash sizes of all the supported chips, to load files
+ * before the chip is known. */
+static void max_flash_sizes(size_t *code_size, size_t *data_size)
+{
+	const struct ch_profile *profile;
+
+	*code_size = 0;
+	*data_size = 0;
+
+	for (profile = profiles; profile->name; profile++) {
+		if (profile->code_flash_size > *code_size)
+			*code_size = profile->code_flash_size;
+		if (profile->data_flash_size > *data_size)
+			*data_size = profile->data_flash_size;
+	}
+}
+
+static void set_chip_profile(struct device *dev, uint8_t family, uint8_t type)
+{
+	const struct ch_profile *profile = find_profile(family, type);
+
+	if (profile == NULL)
+		errx(EXIT_FAILURE, "Device family 0x%02x type 0x%02x is not supported\n",
+		     family, type);
+
+	dev->profile = profile;
+	dev->fw.max_flash_size = profile->code_flash_size;
+	dev->data.max_flash_size = profile->data_flash_size;
+	dev->data_dump.max_flash_size = profile->data_flash_size;
+}
+
+/* Set the bootloader version specific behaviours. Returns false if
+ * the version is not supported. */
+static bool set_bootloader_quirks(struct device *dev)
+{
+	const struct bootloader_rules *rules;
+
+	for (rules = bootloader_rules; rules->version; rules++) {
+		if (rules->version == dev->bv) {
+			dev->rules = rules;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Set up an emulated chip from CHIP[,VERSION][,serial], for instance
+ * CH552,2.5.0. The newest known bootloader is used by default, and
+ * the chip is reached as over USB unless serial is given. */
+static void open_emulator(struct device *dev, const char *spec)
+{
+	struct emulator *emu;
+	const struct ch_profile *profile;
+	const struct bootloader_rules *rules;
+	unsigned int major, minor, patch;
+	const char *version;
+	bool serial = false;
+	size_t name_len;
+	size_t spec_len;
+	uint32_t bv;
+#ifndef WIN32
+	const char *link;
+#endif
+
+	spec_len = strlen(spec);
+#ifndef WIN32
+	link = strrchr(spec, ',');
+	if (link && strcmp(link + 1, "serial") == 0) {
+		serial = true;
+		spec_len = link - spec;
+	}
+#endif
+
+	version = memchr(spec, ',', spec_len);
+	name_len = version ? (size_t)(version - spec) : spec_len;
+
+	for (profile = profiles; profile->name; profile++) {
+		if (strlen(profile->name) == name_len &&
+		    strncasecmp(profile->name, spec, name_len) == 0)
+			break;
+	}
+	if (profile->name == NULL)
+		errx(EXIT_FAILURE, "Unknown chip to emulate '%.*s'",
+		     (int)name_len, spec);
+
+	for (rules = bootloader_rules; rules[1].version; rules++)
+		;
+
+	if (version) {
+		if (sscanf(version + 1, "%u.%u.%u", &major, &minor, &patch) != 3)
+			errx(EXIT_FAILURE, "Invalid bootloader version '%.*s'",
+			     (int)(spec + spec_len - version - 1), version + 1);
+
+		bv = (major << 16) | (minor << 8) | patch;
+		for (rules = bootloader_rules; rules->version; rules++) {
+			if (rules->version == bv)
+				break;
+		}
+		if (rules->version == 0)
+			errx(EXIT_FAILURE, "No rules to emulate bootloader %.*s",
+			     (int)(spec + spec_len - version - 1), version + 1);
+	}
+
+	emu = calloc(1, sizeof(*emu));
+	if (emu == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the emulator");
+
+	emu->profile = profile;
+	emu->rules = rules;
+	emu->serial = serial;
+	memcpy(emu->id, "\x5a\x31\xbc\x0c\x17\x22\x9e\x41", sizeof(emu->id));
+
+	emu->code = malloc(profile->code_flash_size);
+	emu->data = malloc(profile->data_flash_size);
+	if (emu->code == NULL || emu->data == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the emulated flash");
+
+	memset(emu->config, 0xff, sizeof(emu->config));
+	memset(emu->code, 0xff, profile->code_flash_size);
+	memset(emu->data, 0xff, profile->data_flash_size);
+
+	dev->emu = emu;
+}
+
+static int request_chip_type(struct device *dev, struct resp_chip_type *resp)
+{
+	struct req_get_chip_type req = {
+		.hdr.command = CMD_CHIP_TYPE,
+		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+		.string = "MCU ISP & WCH.CN",
+	};
+
+	return transfer(dev, &req, sizeof(req), resp, sizeof(*resp));
+}
+
+static void read_chip_type(struct device *dev)
+{
+	struct resp_chip_type resp;
+	int ret;
+
+	ret = request_chip_type(dev, &resp);
+	if (ret)
+		errx(EXIT_FAILURE, "Can't get the device type");
+
+	if (resp.family == 0)
+		errx(EXIT_FAILURE, "Chip is hosed. Reset or power cycle it.");
+
+	set_chip_profile(dev, resp.family, resp.type);
+}
+
+#ifndef WIN32
+/* Play the enter sequence until the bootloader answers, and read
+ * the chip type */
+static void enter_bootloader(struct device *dev)
+{
+	struct resp_chip_type resp;
+	int i;
+
+	for (i = 0; i < ENTER_RETRIES; i++) {
+		run_line_seq(dev, dev->enter_seq);
+
+		/* Drop what the application sent before the reset */
+		tcflush(dev->fd, TCIOFLUSH);
+
+		if (request_chip_type(dev, &resp) == 0 && resp.family) {
+			set_chip_profile(dev, resp.family, resp.type);
+			return;
+		}
+
+		if (dev->debug)
+			printf("No bootloader after the enter sequence, try %d\n",
+			       i + 1);
+	}
+
+	errx(EXIT_FAILURE, "The bootloader didn't answer after %d tries",
+	     ENTER_RETRIES);
+}
+#endif
+
+static void parse_config(struct device *dev, const struct resp_read_config *resp)
+{
+	dev->bv = be32toh(resp->bootloader_version);
+	memcpy(dev->id, resp->id, dev->profile->mcu_id_len);
+	memcpy(dev->config_data, resp->config_data, sizeof(dev->config_data));
+}
+
+static void read_config(struct device *dev)
+{
+	struct req_read_config req = {
+		.hdr.command = CMD_READ_CONFIG,
+		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+		.what = 0x1f,
+	};
+	struct resp_read_config resp;
+	int ret;
+
+	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+	if (ret)
+		errx(EXIT_FAILURE, "Can't get the device configuration");
+
+	parse_config(dev, &resp);
+}
+
+/* Build the configuration to write. Hardcoded for now. */
+static void prep_write_config(const struct device *dev,
+			      struct req_write_config *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->hdr.command = CMD_WRITE_CONFIG;
+	req->hdr.data_len = sizeof(*req) - sizeof(req->hdr);
+	req->what = 0x07;
+
+	memcpy(req->config_data, dev->config_data, sizeof(req->config_data));
+
+	if (dev->profile->need_remove_wp && req->config_data[0] == 0xff)
+		req->config_data[0] = 0xa5;
+
+	if (dev->profile->clear_cfg_rom_read) {
+		/* CH579 - the CFG_ROM_READ must be cleared, otherwise
+		 * flashing will fail.
+		 */
+		req->config_data[8] &= ~0x80;
+	}
+}
+
+/* Write some configuration */
+static void write_config(struct device *dev)
+{
+	struct req_write_config req;
+	struct resp_write_config resp;
+	int ret;
+
+	prep_write_config(dev, &req);
+
+	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+	if (ret)
+		errx(EXIT_FAILURE, "Can't write the new configuration");
+
+	memcpy(dev->config_after, req.config_data, sizeof(dev->config_after));
+	dev->config_written = true;
+}
+
+/* Erase length for size bytes. It is in KiB blocks, with a minimum
+ * of 8KiB. */
+static int erase_blocks(size_t size)
+{
+	int length;
+
+	length = ((size + 1023) & ~1023) / 1024;
+	if (length < 8)
+		length = 8;
+
+	return length;
+}
+
+/* Code flash to erase. A streamed firmware size is not known yet, so
+ * it is what the caller asked for, or the whole flash. */
+static size_t code_erase_size(const struct device *dev)
+{
+	if (dev->fw.stream)
+		return dev->erase_size ? dev->erase_size : dev->fw.max_flash_size;
+
+	return dev->fw.len;
+}
+
+/* Build the code flash erase request for size bytes */
+static void prep_erase_code_flash(struct req_erase_flash *req, size_t size)
+{
+	memset(req, 0, sizeof(*req));
+	req->hdr.command = CMD_ERASE_CODE_FLASH;
+	req->hdr.data_len = sizeof(*req) - sizeof(req->hdr);
+
+	req->length = erase_blocks(size);
+}
+
+/* Erase the flash */
+static void erase_code_flash(struct device *dev)
+{
+	struct req_erase_flash req;
+	struct resp_erase_flash resp;
+	size_t size;
+	int ret;
+
+	size = code_erase_size(dev);
+	if (size > dev->fw.max_flash_size)
+		errx(EXIT_FAILURE, "Erase size is larger than the code flash");
+
+	prep_erase_code_flash(&req, size);
+
+	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+	if (ret)
+		errx(EXIT_FAILURE, "Can't erase the code flash");
+
+	if (resp.return_code != 0x00)
+		errx(EXIT_FAILURE, "The device refused to erase the code flash");
+}
+
+/* Open a file to flash or verify. "-" is the standard input. */
+static void open_content(struct content *info)
+{
+	struct stat statbuf;
+	int ret;
+	int open_flags = O_RDONLY;
+
+#ifdef WIN32
+	open_flags |= O_BINARY;
+#endif
+
+	if (strcmp(info->filename, "-") == 0)
+		info->fd = STDIN_FILENO;
+	else
+		info->fd = open(info->filename, open_flags);
+	if (info->fd == -1)
+		err(EXIT_FAILURE, "Can't open the firmware file");
+
+	ret = fstat(info->fd, &statbuf);
+	if (ret == -1)
+		err(EXIT_FAILURE, "Can't get firmware file size");
+
+	/* Pipes and FIFOs can't be sized up front */
+	info->stream = !S_ISREG(statbuf.st_mode);
+}
+
+/* Read until len bytes are in, or the end of the file */
+static size_t read_full(int fd, uint8_t *buf, size_t len)
+{
+	size_t total_read = 0;
+	ssize_t ret;
+
+	while (total_read < len) {
+		ret = read(fd, buf + total_read, len - total_read);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			err(EXIT_FAILURE, "Can't read firmware file");
+		if (ret == 0)
+			break;
+		total_read += ret;
+	}
+
+	return total_read;
+}
+
+/* Fail if a stream still has data after the flash is full */
+static void check_stream_end(struct content *info)
+{
+	uint8_t extra;
+
+	if (read_full(info->fd, &extra, 1))
+		errx(EXIT_FAILURE, "Firmware cannot fit in flash");
+}
+
+static void load_file(struct device *dev, struct content *info)
+{
+	struct stat statbuf;
+	int ret;
+	off_t total_read = 0;
+
+	if (info->stream) {
+		/* Read the whole stream, up to the flash size */
+		info->buf = malloc(info->max_flash_size);
+		if (info->buf == NULL)
+			errx(EXIT_FAILURE, "Can't allocate %zd bytes for the firmware",
+			     info->max_flash_size);
+
+		memset(info->buf, 0xff, info->max_flash_size);
+
+		info->len = read_full(info->fd, info->buf, info->max_flash_size);
+		if (info->len == info->max_flash_size)
+			check_stream_end(info);
+
+		info->len = (info->len + 7) & ~7;
+		if (info->len > info->max_flash_size)
+			errx(EXIT_FAILURE, "Firmware cannot fit in flash");
+
+		close(info->fd);
+		return;
+	}
+
+	ret = fstat(info->fd, &statbuf);
+	if (ret == -1)
+		err(EXIT_FAILURE, "Can't get firmware file size");
+
+	/* Round up to 8 bytes boundary as upload protocol requires
+	 * it. Extra bytes are zeroes. */
+	info->len = (statbuf.st_size + 7) & ~7;
+
+	if (info->len > info->max_flash_size)
+		errx(EXIT_FAILURE, "Firmware cannot fit in flash");
+
+	info->buf = malloc(info->len);
+	if (info->buf == NULL)
+	    errx(EXIT_FAILURE, "Can't allocate %zd bytes for the firmware",
+		 info->len);
+
+	memset(info->buf, 0xff, info->len);
+
+	while (total_read < statbuf.st_size) {
+		off_t remaining = statbuf.st_size - total_read;
+		int ret = read(info->fd, info->buf + total_read, remaining);
+		if (dev->debug)
+			printf("info->buf %p total_read %lld statbuf.st_size %lld remaining %lld read %d\n ", info->buf, (long long)total_read, (long long)statbuf.st_size, (long long)remaining, ret);
+		if (ret < 0) {
+			err(EXIT_FAILURE, "Can't read firmware file");
+		}
+		total_read += ret;
+	}
+
+	close(info->fd);
+}
+
+/* Encrypt or decrypt part of some data. offset is where buf is in
+ * the flash. */
+static void xor_range(const struct device *dev, uint8_t *buf, size_t offset,
+		      size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] ^= dev->xor_key[(offset + i) % XOR_KEY_LEN];
+}
+
+/* Overlay the device patches on some clear firmware. offset is where
+ * buf is in the flash. Only the bytes covered by a patch change. */
+static void patch_range(const struct device *dev, uint8_t *buf,
+			size_t offset, size_t len)
+{
+	const uint8_t *value = dev->patch_values;
+	const struct patch *patch;
+	size_t start;
+	size_t end;
+	int i;
+
+	for (i = 0; i < dev->n_patches; value += patch->width, i++) {
+		patch = &dev->patches[i];
+
+		start = patch->offset > offset ? patch->offset : offset;
+		end = patch->offset + patch->width;
+		if (end > offset + len)
+			end = offset + len;
+		if (start >= end)
+			continue;
+
+		memcpy(&buf[start - offset], &value[start - patch->offset],
+		       end - start);
+	}
+}
+
+/* Check the patches are inside an image */
+static bool patches_fit(const struct patch *patches, int n, size_t len)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (patches[i].offset + patches[i].width > len)
+			return false;
+	}
+
+	return true;
+}
+
+/* Encrypt or decrypt some data */
+static void encrypt_or_decrypt(const struct device *dev, struct content *info)
+{
+	xor_range(dev, info->buf, 0, info->len);
+
+	info->encrypted = !info->encrypted;
+}
+
+/* Create the local key to encrypt the data to send */
+static void create_key(struct device *dev)
+{
+	uint8_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < dev->profile->mcu_id_len; i++)
+		sum += dev->id[i];
+
+	for (i = 0; i < XOR_KEY_LEN; i++)
+		dev->xor_key[i] = sum;
+	dev->xor_key[7] += dev->profile->type;
+}
+
+static const struct req_set_key set_key_req = {
+	.hdr.command = CMD_SET_KEY,
+	.hdr.data_len = 0x1e,
+};
+
+/* Checksum the device returns for the key */
+static uint8_t key_checksum(const struct device *dev)
+{
+	uint8_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < XOR_KEY_LEN; i++)
+		sum += dev->xor_key[i];
+
+	return sum;
+}
+
+/* Send the encryption key */
+static void send_key(struct device *dev)
+{
+	struct req_set_key req = set_key_req;
+	struct resp_set_key resp;
+	int ret;
+
+	ret = transfer(dev, &req, sizeof(struct req_hdr) + req.hdr.data_len,
+		       &resp, sizeof(resp));
+	if (ret)
+		errx(EXIT_FAILURE, "Can't set the key");
+
+	if (resp.key_checksum != key_checksum(dev))
+		errx(EXIT_FAILURE, "The device refused the key");
+}
+
+/* Build a flash read or write request for one chunk */
+static void prep_flash_rw(struct req_flash_rw *req, int cmd,
+			  const uint8_t *data, int offset, int len)
+{
+	memset(req, 0, sizeof(*req));
+	req->hdr.command = cmd;
+	req->offset = offset;
+	req->hdr.data_len = len + 5;
+
+	if (len)
+		memcpy(&req->data, data, len);
+}
+
+/* Send one chunk of a flash read or write. Returns the device
+ * return code. */
+static int flash_rw_chunk(struct device *dev, int cmd, const uint8_t *data,
+			  int offset, int len)
+{
+	struct req_flash_rw req;
+	struct resp_flash_rw resp;
+	int ret;
+
+	prep_flash_rw(&req, cmd, data, offset, len);
+
+	ret = transfer(dev, &req, sizeof(struct req_hdr) + req.hdr.data_len,
+		       &resp, sizeof(resp));
+	if (ret)
+		errx(EXIT_FAILURE, "Write failure at offset %d", offset);
+
+	return resp.return_code;
+}
+
+/* read or write code flash, or write data flash */
+static int flash_rw(struct device *dev, int cmd, struct content *info,
+		    int *offset_out)
+{
+	int offset;
+	int to_send;
+	int len;
+	int ret;
+
+	/* Send the firmware in 56 bytes chunks */
+	offset = 0;
+	to_send = info->len;
+	while (to_send) {
+		len = FLASH_CHUNK_SIZE;
+		if (len > to_send)
+			len = to_send;
+
+		ret = flash_rw_chunk(dev, cmd, &info->buf[offset], offset, len);
+		if (ret != 0) {
+			*offset_out = offset;
+			return ret;
+		}
+
+		to_send -= len;
+		offset += len;
+
+		step_progress(dev, offset, info->len);
+	}
+
+	if (cmd == CMD_WRITE_CODE_FLASH && dev->profile->need_last_write) {
+		/* The CH32Fx need a last empty write. */
+		ret = flash_rw_chunk(dev, cmd, NULL, info->len, 0);
+		if (ret != 0) {
+			*offset_out = offset;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void write_code_flash(struct device *dev)
+{
+	int offset;
+	int ret;
+
+	ret = flash_rw(dev, CMD_WRITE_CODE_FLASH, &dev->fw, &offset);
+	if (ret)
+		errx(EXIT_FAILURE, "Write code flash failure at offset %d",
+		     offset);
+}
+
+/* Write the code flash, comparing each region of n chunks right
+ * after it is written, so a failure is found at its region, before
+ * the rest of the image is sent. The bootloader forgets the key when
+ * going from writing to comparing, so it is sent again before each
+ * batch of compares, and before going back to writing. */
+static void write_verify_code_flash(struct device *dev, int n)
+{
+	struct content *info = &dev->fw;
+	size_t region_len = (size_t)n * FLASH_CHUNK_SIZE;
+	size_t region;
+	size_t offset;
+	size_t end;
+	int len;
+	int ret;
+
+	for (region = 0; region < info->len; region += region_len) {
+		end = region + region_len;
+		if (end > info->len)
+			end = info->len;
+
+		if (region)
+			send_key(dev);
+
+		for (offset = region; offset < end; offset += len) {
+			len = end - offset;
+			if (len > FLASH_CHUNK_SIZE)
+				len = FLASH_CHUNK_SIZE;
+
+			ret = flash_rw_chunk(dev, CMD_WRITE_CODE_FLASH,
+					     &info->buf[offset], offset, len);
+			if (ret)
+				errx(EXIT_FAILURE, "Write code flash failure at offset %zd",
+				     offset);
+		}
+
+		if (end == info->len && dev->profile->need_last_write) {
+			/* The CH32Fx need a last empty write. */
+			ret = flash_rw_chunk(dev, CMD_WRITE_CODE_FLASH, NULL,
+					     info->len, 0);
+			if (ret)
+				errx(EXIT_FAILURE, "Write code flash failure at offset %zd",
+				     info->len);
+		}
+
+		send_key(dev);
+
+		for (offset = region; offset < end; offset += len) {
+			len = end - offset;
+			if (len > FLASH_CHUNK_SIZE)
+				len = FLASH_CHUNK_SIZE;
+
+			ret = flash_rw_chunk(dev, CMD_CMP_CODE_FLASH,
+					     &info->buf[offset], offset, len);
+			if (ret)
+				errx(EXIT_FAILURE, "Check code flash failure at offset %zd, "
+				     "in region 0x%zx-0x%zx", offset, region, end);
+		}
+
+		step_progress(dev, end, info->len);
+	}
+}
+
+/* Write the code flash while the firmware is still arriving from a
+ * pipe. Each chunk is padded and encrypted as soon as it is read. The
+ * whole image is kept for the verification. */
+static void stream_code_flash(struct device *dev)
+{
+	struct content *info = &dev->fw;
+	size_t max_size;
+	size_t offset = 0;
+	size_t len;
+	size_t want;
+	int ret;
+
+	/* Only what was erased can be written */
+	max_size = (size_t)erase_blocks(code_erase_size(dev)) * 1024;
+	if (max_size > info->max_flash_size)
+		max_size = info->max_flash_size;
+
+	info->buf = malloc(info->max_flash_size);
+	if (info->buf == NULL)
+		errx(EXIT_FAILURE, "Can't allocate %zd bytes for the firmware",
+		     info->max_flash_size);
+
+	memset(info->buf, 0xff, info->max_flash_size);
+
+	while (offset < max_size) {
+		want = FLASH_CHUNK_SIZE;
+		if (want > max_size - offset)
+			want = max_size - offset;
+
+		len = read_full(info->fd, &info->buf[offset], want);
+		if (len == 0)
+			break;
+
+		/* Round up to 8 bytes boundary. Only the last chunk
+		 * can be short. */
+		len = (len + 7) & ~7;
+		patch_range(dev, &info->buf[offset], offset, len);
+		xor_range(dev, &info->buf[offset], offset, len);
+
+		ret = flash_rw_chunk(dev, CMD_WRITE_CODE_FLASH,
+				     &info->buf[offset], offset, len);
+		if (ret)
+			errx(EXIT_FAILURE, "Write code flash failure at offset %zd",
+			     offset);
+
+		offset += len;
+		step_progress(dev, offset, max_size);
+		if (len < want)
+			break;
+	}
+
+	if (offset == max_size)
+		check_stream_end(info);
+
+	if (!patches_fit(dev->patches, dev->n_patches, offset))
+		errx(EXIT_FAILURE, "A patch is past the end of the firmware");
+
+	info->len = offset;
+	info->encrypted = true;
+	close(info->fd);
+
+	if (dev->profile->need_last_write) {
+		/* The CH32Fx need a last empty write. */
+		ret = flash_rw_chunk(dev, CMD_WRITE_CODE_FLASH, NULL, offset, 0);
+		if (ret)
+			errx(EXIT_FAILURE, "Write code flash failure at offset %zd",
+			     offset);
+	}
+}
+
+static void verify_code_flash(struct device *dev)
+{
+	int offset;
+	int ret;
+
+	ret = flash_rw(dev, CMD_CMP_CODE_FLASH, &dev->fw, &offset);
+	if (ret && dev->rules->sticky_cmp_failure)
+		errx(EXIT_FAILURE, "Check code flash failure at offset %d. "
+		     "Power cycle the chip before verifying again.", offset);
+	if (ret)
+		errx(EXIT_FAILURE, "Check code flash failure at offset %d", offset);
+}
+
+static void erase_data_flash(struct device *dev)
+{
+	struct req_erase_data_flash req = {
+		.hdr.command = CMD_ERASE_DATA_FLASH,
+	};
+	struct resp_erase_data_flash resp;
+	size_t length;
+	int ret;
+
+	/* Erase length is in KiB blocks, with a minimum of 1KiB */
+	length = ((dev->profile->data_flash_size + 1023) & ~1023) / 1024;
+	if (length < 1)
+		length = 1;
+
+	req.len = length;
+
+	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+	if (ret)
+		errx(EXIT_FAILURE, "Can't erase the data flash");
+
+	if (resp.return_code != 0x00)
+		errx(EXIT_FAILURE, "The device refused to erase the data flash");
+}
+
+static void write_data_flash(struct device *dev)
+{
+	int ret;
+	int offset;
+
+	ret = flash_rw(dev, CMD_WRITE_DATA_FLASH, &dev->data, &offset);
+	if (ret)
+		errx(EXIT_FAILURE, "Write data flash failure at offset %d",
+		     offset);
+}
+
+/* Read the first to_read bytes of the data flash */
+static void read_data_flash(struct device *dev, int to_read)
+{
+	struct req_read_data_flash req = {
+		.hdr.command = CMD_READ_DATA_FLASH,
+	};
+	struct resp_read_data_flash resp;
+	int offset;
+	int len;
+	int ret;
+
+	free(dev->data_dump.buf);
 	dev->data_dump.len = to_read;
-	dev->data_dump.buf = calloc(1, to_read);
+	dev->data_dump.buf = calloc(1, dev->data_dump.max_flash_size);
 	if (!dev->data_dump.buf)
-		errx(EXIT_FAILURE, "Can't allocate %u bytes for the data flash",
-		     to_read);
+		errx(EXIT_FAILURE, "Can't allocate %zu bytes for the data flash",
+		     dev->data_dump.max_flash_size);
+
+	offset = 0;
+
+	while (to_read) {
+		req.offset = offset;
+
+		len = sizeof(resp.data);
+		if (len > to_read)
+			len = to_read;
+
+		req.len = len;
+
+		ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+		if (ret)
+			errx(EXIT_FAILURE, "Data read failure at offset %d", offset);
+
+		if (resp.return_code != 0)
+			errx(EXIT_FAILURE, "Data read failure at offset %d", offset);
+
+		memcpy(&dev->data_dump.buf[offset], resp.data, len);
+
+		to_read -= len;
+		offset += len;
+
+		step_progress(dev, offset, dev->data_dump.len);
+	}
+}
+
+static void verify_data_flash(struct device *dev)
+{
+	if (dev->data.encrypted) {
+		/* The data was just written previously to the flash,
+		 * and encrypted. It needs to been decrypted now so
+		 * the comparison can happen. */
+		encrypt_or_decrypt(dev, &dev->data);
+	}
+
+	if (memcmp(dev->data.buf, dev->data_dump.buf, dev->data.len) != 0)
+		errx(EXIT_FAILURE, "Data flash doesn't match");
+}
+
+static void dump_data_flash(struct device *dev)
+{
+	int fd;
+	int ret;
+
+	fd = creat(dev->data_dump.filename, 0600);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Can't create the file to dump the data flash");
+
+	ret = write(fd, dev->data_dump.buf, dev->data.max_flash_size);
+	if (ret == -1)
+		err(EXIT_FAILURE, "Can't dump the data flash");
+
+	if (ret != dev->profile->data_flash_size)
+		err(EXIT_FAILURE, "Can't dump all the data flash to file");
+
+	close(fd);
+}
+
+/* Data flash archive. Each harvested board adds an entry, pointing to
+ * a blob with the content of its data flash. Boards with the same
+ * content, like the factory defaults, share the blob. The file is
+ * memory mapped, and sparse until used. Adding an entry is serialized
+ * with a lock, held for a few microseconds. */
+
+static uint64_t fnv1a64(const uint8_t *buf, size_t len)
+{
+	uint64_t hash = 14695981039346656037ull;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ buf[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+/* Parse a chip ID such as 01-02-03-04. Returns its length. */
+static int parse_chip_id(const char *str, uint8_t *id)
+{
+	const char *p = str;
+	int id_len = 0;
+
+	while (*p && id_len < 8) {
+		if (*p == '-' || *p == ':') {
+			p++;
+			continue;
+		}
+
+		if (sscanf(p, "%2hhx", &id[id_len]) != 1)
+			errx(EXIT_FAILURE, "Invalid chip ID '%s'", str);
+		id_len++;
+		p += 2;
+	}
+
+	return id_len;
+}
+
+/* Map an archive file, creating it if needed */
+static void open_archive(struct archive *arc, const char *filename)
+{
+	struct arc_header hdr = {
+		.magic = ARC_MAGIC,
+		.version = 1,
+		.entry_size = sizeof(struct arc_entry),
+		.capacity = ARC_DEFAULT_CAPACITY,
+		.blob_space = ARC_DEFAULT_BLOB_SPACE,
+	};
+	struct stat statbuf;
+
+	arc->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (arc->fd == -1)
+		err(EXIT_FAILURE, "Can't open the archive '%s'", filename);
+
+	if (flock(arc->fd, LOCK_EX) == -1)
+		err(EXIT_FAILURE, "Can't lock the archive");
+
+	if (fstat(arc->fd, &statbuf) == -1)
+		err(EXIT_FAILURE, "Can't get the archive size");
+
+	if (statbuf.st_size == 0) {
+		if (write(arc->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+			err(EXIT_FAILURE, "Can't initialize the archive");
+
+		if (ftruncate(arc->fd, sizeof(hdr) +
+			      hdr.capacity * sizeof(struct arc_entry) +
+			      hdr.blob_space) == -1)
+			err(EXIT_FAILURE, "Can't size the archive");
+
+		if (fstat(arc->fd, &statbuf) == -1)
+			err(EXIT_FAILURE, "Can't get the archive size");
+	}
+
+	flock(arc->fd, LOCK_UN);
+
+	arc->map_len = statbuf.st_size;
+	arc->hdr = mmap(NULL, arc->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, arc->fd, 0);
+	if (arc->hdr == MAP_FAILED)
+		err(EXIT_FAILURE, "Can't map the archive");
+
+	if (memcmp(arc->hdr->magic, ARC_MAGIC, sizeof(arc->hdr->magic)) != 0 ||
+	    arc->hdr->entry_size != sizeof(struct arc_entry) ||
+	    arc->map_len < sizeof(struct arc_header) +
+	    arc->hdr->capacity * sizeof(struct arc_entry) +
+	    arc->hdr->blob_space)
+		errx(EXIT_FAILURE, "'%s' is not a valid archive", filename);
+
+	arc->entries = (struct arc_entry *)(arc->hdr + 1);
+	arc->blobs = (uint8_t *)(arc->entries + arc->hdr->capacity);
+}
+
+static struct arc_blob *arc_blob(const struct archive *arc, uint64_t offset)
+{
+	return (struct arc_blob *)(arc->blobs + offset);
+}
+
+/* Find a blob with that content, or add it. Returns its offset, or -1
+ * if the archive is full. Called with the lock held. */
+static int64_t store_blob(struct archive *arc, const uint8_t *buf,
+			  size_t len)
+{
+	uint64_t hash = fnv1a64(buf, len);
+	uint64_t *bucket = &arc->hdr->blob_buckets[hash % ARC_BUCKETS];
+	struct arc_blob *blob;
+	uint64_t offset;
+	size_t size;
+
+	for (offset = *bucket; offset; offset = blob->next) {
+		blob = arc_blob(arc, offset - 1);
+		if (blob->hash == hash && blob->len == len &&
+		    memcmp(blob->data, buf, len) == 0) {
+			blob->refs++;
+			return offset - 1;
+		}
+	}
+
+	size = (sizeof(*blob) + len + 7) & ~(size_t)7;
+	offset = arc->hdr->blob_used;
+	if (offset + size > arc->hdr->blob_space)
+		return -1;
+
+	blob = arc_blob(arc, offset);
+	blob->hash = hash;
+	blob->len = len;
+	blob->refs = 1;
+	memcpy(blob->data, buf, len);
+	blob->next = *bucket;
+
+	*bucket = offset + 1;
+	arc->hdr->blob_used += size;
+	arc->hdr->n_blobs++;
+
+	return offset;
+}
+
+/* Add the data flash just read to the archive */
+static void harvest_data_flash(struct device *dev)
+{
+	struct archive *arc = dev->archive;
+	struct arc_entry *entry;
+	uint64_t *bucket;
+	uint64_t index;
+	uint64_t n_blobs;
+	int64_t blob;
+	uintptr_t page;
+
+	if (dev->data_dump.len == 0)
+		errx(EXIT_FAILURE, "This chip has no data flash to harvest");
+
+	if (flock(arc->fd, LOCK_EX) == -1)
+		err(EXIT_FAILURE, "Can't lock the archive");
+
+	index = arc->hdr->next;
+	if (index >= arc->hdr->capacity)
+		errx(EXIT_FAILURE, "The archive is full");
+
+	n_blobs = arc->hdr->n_blobs;
+	blob = store_blob(arc, dev->data_dump.buf, dev->data_dump.len);
+	if (blob < 0)
+		errx(EXIT_FAILURE, "The archive is full");
+
+	entry = &arc->entries[index];
+	memset(entry, 0, sizeof(*entry));
+	entry->blob = blob;
+	entry->time_us = wall_clock_us();
+	entry->id_len = dev->profile->mcu_id_len;
+	memcpy(entry->id, dev->id, entry->id_len);
+	entry->family = dev->profile->family;
+	entry->type = dev->profile->type;
+	strncpy(entry->chip, dev->profile->name, sizeof(entry->chip) - 1);
+
+	bucket = &arc->hdr->id_buckets[fnv1a64(entry->id, entry->id_len) %
+				       ARC_BUCKETS];
+	entry->prev = *bucket;
+	*bucket = index + 1;
+
+	/* Readers don't lock, and only look at published entries */
+	__atomic_store_n(&arc->hdr->next, index + 1, __ATOMIC_RELEASE);
+
+	flock(arc->fd, LOCK_UN);
+
+	page = (uintptr_t)arc->hdr & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+	msync((void *)page, arc->map_len, MS_ASYNC);
+
+	printf("Harvested data flash as entry #%llu, %s content %016llx\n",
+	       (unsigned long long)index,
+	       n_blobs == arc->hdr->n_blobs ? "known" : "new",
+	       (unsigned long long)arc_blob(arc, blob)->hash);
+}
+
+/* Find an entry from #INDEX, or the latest one for a chip ID */
+static const struct arc_entry *find_entry(const struct archive *arc,
+					  const char *key)
+{
+	uint64_t count = __atomic_load_n(&arc->hdr->next, __ATOMIC_ACQUIRE);
+	const struct arc_entry *entry;
+	uint8_t id[8];
+	uint64_t index;
+	int id_len;
+	char *end;
+
+	if (key[0] == '#') {
+		index = strtoull(key + 1, &end, 10);
+		if (*end || end == key + 1 || index >= count)
+			errx(EXIT_FAILURE, "No archive entry '%s'", key);
+
+		return &arc->entries[index];
+	}
+
+	id_len = parse_chip_id(key, id);
+	index = arc->hdr->id_buckets[fnv1a64(id, id_len) % ARC_BUCKETS];
+	while (index) {
+		entry = &arc->entries[index - 1];
+		if (index - 1 < count && entry->id_len == id_len &&
+		    memcmp(entry->id, id, id_len) == 0)
+			return entry;
+		index = entry->prev;
+	}
+
+	errx(EXIT_FAILURE, "No archive entry for chip ID '%s'", key);
+}
+
+static void print_entry(const struct archive *arc, uint64_t index)
+{
+	const struct arc_entry *entry = &arc->entries[index];
+	const struct arc_blob *blob = arc_blob(arc, entry->blob);
+	int i;
+
+	printf("#%llu %lld.%06lld ", (unsigned long long)index,
+	       (long long)(entry->time_us / 1000000),
+	       (long long)(entry->time_us % 1000000));
+
+	for (i = 0; i < entry->id_len; i++)
+		printf("%s%02x", i ? "-" : "", entry->id[i]);
+
+	printf(" %s %016llx/%u shared=%u\n", entry->chip[0] ? entry->chip : "?",
+	       (unsigned long long)blob->hash, blob->len, blob->refs);
+}
+
+/* Print the differing byte ranges of two blobs */
+static void diff_blobs(const struct arc_blob *a, const struct arc_blob *b)
+{
+	uint32_t len = a->len < b->len ? a->len : b->len;
+	uint32_t start;
+	uint32_t end;
+	uint32_t i;
+
+	if (a == b) {
+		printf("Identical\n");
+		return;
+	}
+
+	for (start = 0; start < len; start = end) {
+		if (a->data[start] == b->data[start]) {
+			end = start + 1;
+			continue;
+		}
+
+		for (end = start; end < len && end - start < 16 &&
+			     a->data[end] != b->data[end]; end++)
+			;
+
+		printf("0x%04x:", start);
+		for (i = start; i < end; i++)
+			printf(" %02x", a->data[i]);
+		printf(" ->");
+		for (i = start; i < end; i++)
+			printf(" %02x", b->data[i]);
+		printf("\n");
+	}
+
+	if (a->len != b->len)
+		printf("Lengths differ, %u and %u bytes\n", a->len, b->len);
+}
+
+/* List the entries, extract the content of one, or diff two */
+static void query_archive(struct archive *arc, char *query)
+{
+	uint64_t count = __atomic_load_n(&arc->hdr->next, __ATOMIC_ACQUIRE);
+	const struct arc_entry *entry;
+	const struct arc_blob *blob;
+	char *second;
+	uint64_t index;
+	FILE *f;
+
+	if (strcmp(query, "list") == 0) {
+		for (index = 0; index < count; index++)
+			print_entry(arc, index);
+
+		printf("%llu boards, %llu distinct contents, %llu KiB stored\n",
+		       (unsigned long long)count,
+		       (unsigned long long)arc->hdr->n_blobs,
+		       (unsigned long long)(arc->hdr->blob_used + 1023) / 1024);
+	} else if (strncmp(query, "extract=", 8) == 0) {
+		second = strchr(query + 8, ',');
+		if (second)
+			*second++ = '\0';
+
+		entry = find_entry(arc, query + 8);
+		blob = arc_blob(arc, entry->blob);
+
+		f = second ? fopen(second, "wb") : stdout;
+		if (f == NULL)
+			err(EXIT_FAILURE, "Can't create '%s'", second);
+
+		if (fwrite(blob->data, 1, blob->len, f) != blob->len)
+			err(EXIT_FAILURE, "Can't extract the data flash");
+
+		if (second)
+			fclose(f);
+	} else if (strncmp(query, "diff=", 5) == 0) {
+		second = strchr(query + 5, ',');
+		if (second == NULL)
+			errx(EXIT_FAILURE, "A diff needs two entries");
+		*second++ = '\0';
+
+		diff_blobs(arc_blob(arc, find_entry(arc, query + 5)->blob),
+			   arc_blob(arc, find_entry(arc, second)->blob));
+	} else {
+		errx(EXIT_FAILURE, "Invalid archive query '%s'", query);
+	}
+}
+
+/* Match a string against a pattern with * and ? wildcards */
+static bool match_pattern(const char *pattern, const char *str)
+{
+	if (*pattern == '\0')
+		return *str == '\0';
+
+	if (*pattern == '*')
+		return match_pattern(pattern + 1, str) ||
+			(*str && match_pattern(pattern, str + 1));
+
+	if (*str == '\0')
+		return false;
+
+	if (*pattern == '?' || toupper(*pattern) == toupper(*str))
+		return match_pattern(pattern + 1, str + 1);
+
+	return false;
+}
+
+/* Load a routing table. Each line is a chip name or a family/type
+ * pattern, followed by the images to use:
+ *
+ *   CH552      code=ch552.bin
+ *   CH58?      code=ch58x.bin data=cal.bin
+ *   0x11/0x5*  code=ch55x.bin config=skip
+ *
+ * All the images are loaded here, once, before any device is touched.
+ */
+static int load_routes(struct device *dev, const char *filename,
+		       struct route **routes_out)
+{
+	struct route *routes = NULL;
+	struct route *route;
+	size_t max_code_size;
+	size_t max_data_size;
+	char line[512];
+	char *token;
+	int n = 0;
+	int lineno = 0;
+	FILE *f;
+
+	/* Images are checked against the real chip once it is known */
+	max_flash_sizes(&max_code_size, &max_data_size);
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't open the routing table");
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		token = strchr(line, '#');
+		if (token)
+			*token = '\0';
+
+		token = strtok(line, " \t\r\n");
+		if (token == NULL)
+			continue;
+
+		routes = realloc(routes, (n + 1) * sizeof(*routes));
+		if (routes == NULL)
+			errx(EXIT_FAILURE, "Can't allocate the routing table");
+
+		route = &routes[n++];
+		memset(route, 0, sizeof(*route));
+		route->pattern = strdup(token);
+		route->fw.max_flash_size = max_code_size;
+		route->data.max_flash_size = max_data_size;
+
+		while ((token = strtok(NULL, " \t\r\n"))) {
+			if (strncmp(token, "code=", 5) == 0)
+				route->fw.filename = strdup(token + 5);
+			else if (strncmp(token, "data=", 5) == 0)
+				route->data.filename = strdup(token + 5);
+			else if (strcmp(token, "config=skip") == 0)
+				route->skip_config = true;
+			else if (strcmp(token, "config=write") == 0)
+				route->skip_config = false;
+			else
+				errx(EXIT_FAILURE, "%s:%d: invalid route entry '%s'",
+				     filename, lineno, token);
+		}
+
+		if (!route->fw.filename && !route->data.filename)
+			errx(EXIT_FAILURE, "%s:%d: route has no image",
+			     filename, lineno);
+
+		if (route->fw.filename) {
+			open_content(&route->fw);
+			if (route->fw.stream)
+				errx(EXIT_FAILURE, "%s:%d: routed images can't be streamed",
+				     filename, lineno);
+			load_file(dev, &route->fw);
+		}
+
+		if (route->data.filename) {
+			open_content(&route->data);
+			load_file(dev, &route->data);
+		}
+	}
+
+	fclose(f);
+
+	*routes_out = routes;
+
+	return n;
+}
+
+/* Find the first route matching a chip */
+static const struct route *find_route(const struct ch_profile *profile,
+				      const struct route *routes, int n)
+{
+	char family_type[16];
+	int i;
+
+	snprintf(family_type, sizeof(family_type), "0x%02x/0x%02x",
+		 profile->family, profile->type);
+
+	for (i = 0; i < n; i++) {
+		if (match_pattern(routes[i].pattern, profile->name) ||
+		    match_pattern(routes[i].pattern, family_type))
+			return &routes[i];
+	}
+
+	return NULL;
+}
+
+static const struct route *select_route(const struct device *dev,
+					const struct route *routes, int n)
+{
+	const struct route *route = find_route(dev->profile, routes, n);
+
+	if (route == NULL)
+		errx(EXIT_FAILURE, "No route for device %s (0x%02x/0x%02x)",
+		     dev->profile->name, dev->profile->family,
+		     dev->profile->type);
+
+	return route;
+}
+
+/* Reboot the device */
+static void reboot_device(struct device *dev)
+{
+	struct req_reboot req = {
+		.hdr.command = CMD_REBOOT,
+		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+		.option = 0x01,
+	};
+	struct resp_reboot resp;
+	int ret;
+
+	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+
+	/* 2.4.0 bootloaders do not respond. 2.8.0 does. */
+	if (!dev->rules->wait_reboot_resp)
+		return;
+
+	if (ret)
+		errx(EXIT_FAILURE, "Can't reboot the device");
+
+	if (resp.return_code != 0x00)
+		errx(EXIT_FAILURE, "The device refused to reboot");
+}
+
+/* Whether the configuration write would change anything, including
+ * over one already written in this session */
+static bool config_needs_write(const struct device *dev)
+{
+	const uint8_t *current = dev->config_written ?
+		dev->config_after : dev->config_data;
+	struct req_write_config req;
+
+	prep_write_config(dev, &req);
+
+	return memcmp(req.config_data, current,
+		      sizeof(req.config_data)) != 0;
+}
+
+static void plan_add(struct plan *plan, enum step step)
+{
+	if (plan->n == MAX_STEPS)
+		errx(EXIT_FAILURE, "Session plan is too long");
+
+	plan->steps[plan->n++] = step;
+}
+
+/* Turn the requested operations into an ordered list of steps,
+ * dropping the commands the bootloader doesn't need. The device
+ * configuration must have been read already. */
+static void plan_session(const struct device *dev,
+			 const struct session_ops *ops, struct plan *plan)
+{
+	plan->n = 0;
+	plan->data_read_len = 0;
+	plan->interleave = 0;
+
+	/* Interleaving sends the same writes and compares as verifying
+	 * afterwards, plus a key for each region, so it only pays off
+	 * when a failure is found early */
+	if (ops->code_flash && ops->interleave) {
+		if (dev->profile->need_last_write)
+			printf("Chip only commits the writes at the end, verifying after flashing\n");
+		else if (dev->fw.stream)
+			printf("Streamed firmware is verified after flashing\n");
+		else
+			plan->interleave = ops->interleave;
+	}
+
+	if (ops->code_flash) {
+		plan_add(plan, STEP_SET_KEY);
+
+		if (ops->write_config && (ops->full || config_needs_write(dev)))
+			plan_add(plan, STEP_WRITE_CONFIG);
+
+		plan_add(plan, STEP_ERASE_CODE);
+		plan_add(plan, STEP_WRITE_CODE);
+	}
+
+	if (ops->code_verify && !plan->interleave) {
+		plan_add(plan, STEP_SET_KEY);
+		plan_add(plan, STEP_VERIFY_CODE);
+	}
+
+	if (ops->data_flash) {
+		plan_add(plan, STEP_SET_KEY);
+		plan_add(plan, STEP_ERASE_DATA);
+		plan_add(plan, STEP_WRITE_DATA);
+	}
+
+	/* A single read serves both the verification and the dump.
+	 * A verification alone only needs what was written. */
+	if (ops->data_verify || ops->data_dump) {
+		if (ops->data_dump || ops->full)
+			plan->data_read_len = dev->data_dump.max_flash_size;
+		else
+			plan->data_read_len = dev->data.len;
+
+		plan_add(plan, STEP_READ_DATA);
+	}
+
+	if (ops->data_verify)
+		plan_add(plan, STEP_VERIFY_DATA);
+
+	if (ops->data_dump)
+		plan_add(plan, STEP_DUMP_DATA);
+
+	if (ops->code_flash)
+		plan_add(plan, STEP_REBOOT);
+
+	if (dev->debug) {
+		int i;
+
+		printf("Session plan:");
+		for (i = 0; i < plan->n; i++)
+			printf("%s %s", i ? "," : "", step_names[plan->steps[i]]);
+		printf("\n");
+	}
+}
+
+static void run_step(struct device *dev, const struct plan *plan,
+		     enum step step)
+{
+	switch (step) {
+	case STEP_SET_KEY:
+		send_key(dev);
+		break;
+
+	case STEP_WRITE_CONFIG:
+		write_config(dev);
+		break;
+
+	case STEP_ERASE_CODE:
+		erase_code_flash(dev);
+		break;
+
+	case STEP_WRITE_CODE:
+		if (dev->fw.stream)
+			stream_code_flash(dev);
+		else if (plan->interleave)
+			write_verify_code_flash(dev, plan->interleave);
+		else
+			write_code_flash(dev);
+
+		printf("Code flashing successful\n");
+		if (plan->interleave)
+			printf("Firmware is good\n");
+		break;
+
+	case STEP_VERIFY_CODE:
+		verify_code_flash(dev);
+
+		printf("Firmware is good\n");
+		break;
+
+	case STEP_ERASE_DATA:
+		erase_data_flash(dev);
+		break;
+
+	case STEP_WRITE_DATA:
+		encrypt_or_decrypt(dev, &dev->data);
+		write_data_flash(dev);
+
+		printf("Data flashing successful\n");
+		break;
+
+	case STEP_READ_DATA:
+		read_data_flash(dev, plan->data_read_len);
+		break;
+
+	case STEP_VERIFY_DATA:
+		verify_data_flash(dev);
+
+		printf("Data flash is good\n");
+		break;
+
+	case STEP_DUMP_DATA:
+		if (dev->data_dump.filename) {
+			dump_data_flash(dev);
+
+			printf("Dumped data flash to file\n");
+		}
+
+#ifndef WIN32
+		if (dev->archive)
+			harvest_data_flash(dev);
+#endif
+		break;
+
+	case STEP_REBOOT:
+		dev->reboot_ms = now_ms();
+		reboot_device(dev);
+
+#ifndef WIN32
+		if (dev->reset_seq)
+			run_line_seq(dev, dev->reset_seq);
+#endif
+		break;
+	}
+}
+
+static void run_plan(struct device *dev, const struct plan *plan)
+{
+	double start;
+	int i;
+
+	for (i = 0; i < plan->n; i++) {
+		dev->step = plan->steps[i];
+		start = now_ms();
+		step_progress(dev, 0, 0);
+
+		run_step(dev, plan, plan->steps[i]);
+
+		dev->step_ms[plan->steps[i]] += now_ms() - start;
+	}
+
+	dev->step = -1;
+}
+
+/* Job manifest. One operation per line, with its arguments:
+ *   dump-data FILE
+ *   write-code FILE
+ *   verify-code [FILE]		the last code written by default
+ *   write-data FILE [keep=OFFSET:LEN]...
+ *   verify-data FILE
+ *   write-config
+ *   reboot
+ * Every image is loaded while parsing, before the device is opened. */
+static const char *job_op_names[] = {
+	[JOB_DUMP_DATA] = "dump-data",
+	[JOB_WRITE_CODE] = "write-code",
+	[JOB_VERIFY_CODE] = "verify-code",
+	[JOB_WRITE_DATA] = "write-data",
+	[JOB_VERIFY_DATA] = "verify-data",
+	[JOB_WRITE_CONFIG] = "write-config",
+	[JOB_REBOOT] = "reboot",
+};
+
+static void load_job(struct device *dev, struct job *job, const char *filename)
+{
+	struct content *last_code = NULL;
+	struct job_op *op;
+	struct job_keep *keep;
+	size_t max_code_size;
+	size_t max_data_size;
+	char line[512];
+	char *token;
+	char *end;
+	int lineno = 0;
+	FILE *f;
+	int i;
+
+	/* Images are checked against the real chip once it is known */
+	max_flash_sizes(&max_code_size, &max_data_size);
+
+	memset(job, 0, sizeof(*job));
+	job->filename = filename;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't open the job manifest");
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		token = strchr(line, '#');
+		if (token)
+			*token = '\0';
+
+		token = strtok(line, " \t\r\n");
+		if (token == NULL)
+			continue;
+
+		if (job->n == MAX_JOB_OPS)
+			errx(EXIT_FAILURE, "%s:%d: too many operations",
+			     filename, lineno);
+
+		/* The bootloader is gone once rebooted */
+		if (job->n && job->ops[job->n - 1].type == JOB_REBOOT)
+			errx(EXIT_FAILURE, "%s:%d: no operation can follow reboot",
+			     filename, lineno);
+
+		op = &job->ops[job->n++];
+		op->line = lineno;
+
+		for (i = 0; i <= JOB_REBOOT; i++) {
+			if (strcmp(token, job_op_names[i]) == 0)
+				break;
+		}
+		if (i > JOB_REBOOT)
+			errx(EXIT_FAILURE, "%s:%d: invalid operation '%s'",
+			     filename, lineno, token);
+		op->type = i;
+
+		token = strtok(NULL, " \t\r\n");
+		if (token) {
+			if (op->type == JOB_WRITE_CONFIG || op->type == JOB_REBOOT)
+				errx(EXIT_FAILURE, "%s:%d: %s has no file",
+				     filename, lineno, job_op_names[op->type]);
+			if (strcmp(token, "-") == 0)
+				errx(EXIT_FAILURE, "%s:%d: jobs can't use stdin",
+				     filename, lineno);
+
+			op->content.filename = strdup(token);
+		} else if (op->type != JOB_WRITE_CONFIG &&
+			   op->type != JOB_REBOOT &&
+			   op->type != JOB_VERIFY_CODE) {
+			errx(EXIT_FAILURE, "%s:%d: %s needs a file",
+			     filename, lineno, job_op_names[op->type]);
+		}
+
+		while ((token = strtok(NULL, " \t\r\n"))) {
+			if (op->type != JOB_WRITE_DATA ||
+			    strncmp(token, "keep=", 5) != 0)
+				errx(EXIT_FAILURE, "%s:%d: invalid argument '%s'",
+				     filename, lineno, token);
+			if (op->n_keep == MAX_JOB_KEEPS)
+				errx(EXIT_FAILURE, "%s:%d: too many kept regions",
+				     filename, lineno);
+
+			keep = &op->keep[op->n_keep++];
+			keep->offset = strtoul(token + 5, &end, 0);
+			if (*end != ':')
+				errx(EXIT_FAILURE, "%s:%d: invalid region '%s'",
+				     filename, lineno, token + 5);
+			keep->len = strtoul(end + 1, &end, 0);
+			if (*end || keep->len == 0 ||
+			    keep->offset + keep->len > max_data_size)
+				errx(EXIT_FAILURE, "%s:%d: invalid region '%s'",
+				     filename, lineno, token + 5);
+		}
+
+		op->image = &op->content;
+
+		switch (op->type) {
+		case JOB_DUMP_DATA:
+			/* Written by the job, so it can't be read by a
+			 * later operation */
+			op->image = NULL;
+			break;
+
+		case JOB_VERIFY_CODE:
+			if (op->content.filename == NULL) {
+				if (last_code == NULL)
+					errx(EXIT_FAILURE, "%s:%d: no code written before",
+					     filename, lineno);
+				op->image = last_code;
+				break;
+			}
+			/* fall through */
+		case JOB_WRITE_CODE:
+			op->content.max_flash_size = max_code_size;
+			open_content(&op->content);
+			load_file(dev, &op->content);
+			if (op->type == JOB_WRITE_CODE)
+				last_code = &op->content;
+			break;
+
+		case JOB_WRITE_DATA:
+		case JOB_VERIFY_DATA:
+			op->content.max_flash_size = max_data_size;
+			open_content(&op->content);
+			load_file(dev, &op->content);
+			break;
+
+		case JOB_WRITE_CONFIG:
+		case JOB_REBOOT:
+			op->image = NULL;
+			break;
+		}
+
+		for (i = 0; op->image == &op->content && i < job->n - 1; i++) {
+			if (job->ops[i].type == JOB_DUMP_DATA &&
+			    strcmp(job->ops[i].content.filename,
+				   op->content.filename) == 0)
+				errx(EXIT_FAILURE, "%s:%d: '%s' is only dumped by the job, use keep= to restore a region",
+				     filename, lineno, op->content.filename);
+		}
+	}
+
+	fclose(f);
+
+	if (job->n == 0)
+		errx(EXIT_FAILURE, "The job %s is empty", filename);
+}
+
+/* Check the images against the chip, and encrypt the code images with
+ * its key. The kept regions are padded into the data images. */
+static void prepare_job(struct device *dev, struct job *job)
+{
+	struct job_op *op;
+	struct content *image;
+	size_t end;
+	int i;
+	int j;
+
+	for (i = 0; i < job->n; i++) {
+		op = &job->ops[i];
+		image = op->image;
+		if (image == NULL)
+			continue;
+
+		if (op->type == JOB_WRITE_CODE || op->type == JOB_VERIFY_CODE) {
+			if (image->len > dev->fw.max_flash_size)
+				errx(EXIT_FAILURE, "%s:%d: firmware cannot fit in flash",
+				     job->filename, op->line);
+			if (!image->encrypted)
+				encrypt_or_decrypt(dev, image);
+			continue;
+		}
+
+		for (j = 0; j < op->n_keep; j++) {
+			end = (op->keep[j].offset + op->keep[j].len + 7) & ~7;
+			if (end <= image->len)
+				continue;
+
+			image->buf = realloc(image->buf, end);
+			if (image->buf == NULL)
+				errx(EXIT_FAILURE, "Can't allocate the data image");
+			memset(image->buf + image->len, 0xff, end - image->len);
+			image->len = end;
+		}
+
+		if (image->len > dev->data.max_flash_size)
+			errx(EXIT_FAILURE, "%s:%d: data cannot fit in flash",
+			     job->filename, op->line);
+	}
+}
+
+/* Run the operations of the job, in a single session. The key is sent
+ * before each operation that needs it. */
+static void run_job(struct device *dev, const struct job *job, bool full)
+{
+	const struct job_op *op;
+	struct plan plan;
+	size_t end;
+	int i;
+	int j;
+
+	for (i = 0; i < job->n; i++) {
+		op = &job->ops[i];
+
+		if (dev->debug)
+			printf("Job operation %s\n", job_op_names[op->type]);
+
+		memset(&plan, 0, sizeof(plan));
+
+		switch (op->type) {
+		case JOB_DUMP_DATA:
+			dev->data_dump.filename = op->content.filename;
+			plan.data_read_len = dev->data_dump.max_flash_size;
+			plan_add(&plan, STEP_READ_DATA);
+			plan_add(&plan, STEP_DUMP_DATA);
+			break;
+
+		case JOB_WRITE_CODE:
+			dev->fw = *op->image;
+			plan_add(&plan, STEP_SET_KEY);
+
+			/* As for a session, some chips need their
+			 * configuration written before the erase */
+			if (full || config_needs_write(dev))
+				plan_add(&plan, STEP_WRITE_CONFIG);
+
+			plan_add(&plan, STEP_ERASE_CODE);
+			plan_add(&plan, STEP_WRITE_CODE);
+			break;
+
+		case JOB_VERIFY_CODE:
+			dev->fw = *op->image;
+			plan_add(&plan, STEP_SET_KEY);
+			plan_add(&plan, STEP_VERIFY_CODE);
+			break;
+
+		case JOB_WRITE_DATA:
+			dev->data = *op->image;
+
+			/* Read the regions to keep first, into the image */
+			if (op->n_keep) {
+				for (j = 0; j < op->n_keep; j++) {
+					end = op->keep[j].offset + op->keep[j].len;
+					if (end > plan.data_read_len)
+						plan.data_read_len = end;
+				}
+				plan_add(&plan, STEP_READ_DATA);
+				run_plan(dev, &plan);
+
+				for (j = 0; j < op->n_keep; j++)
+					memcpy(dev->data.buf + op->keep[j].offset,
+					       dev->data_dump.buf + op->keep[j].offset,
+					       op->keep[j].len);
+				plan.n = 0;
+			}
+
+			plan_add(&plan, STEP_SET_KEY);
+			plan_add(&plan, STEP_ERASE_DATA);
+			plan_add(&plan, STEP_WRITE_DATA);
+			break;
+
+		case JOB_VERIFY_DATA:
+			dev->data = *op->image;
+			plan.data_read_len = dev->data.len;
+			plan_add(&plan, STEP_READ_DATA);
+			plan_add(&plan, STEP_VERIFY_DATA);
+			break;
+
+		case JOB_WRITE_CONFIG:
+			if (full || config_needs_write(dev)) {
+				plan_add(&plan, STEP_SET_KEY);
+				plan_add(&plan, STEP_WRITE_CONFIG);
+			}
+			break;
+
+		case JOB_REBOOT:
+			plan_add(&plan, STEP_REBOOT);
+			break;
+		}
+
+		run_plan(dev, &plan);
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/* CRC of the clear content, whether it is encrypted or not */
+static uint32_t content_crc(const struct device *dev,
+			    const struct content *info)
+{
+	uint8_t chunk[XOR_KEY_LEN * 64];
+	uint32_t crc = 0;
+	size_t len;
+	size_t i;
+	size_t j;
+
+	if (info->crc_valid)
+		return info->crc;
+
+	if (!info->encrypted)
+		return crc32(0, info->buf, info->len);
+
+	/* Decrypted a chunk at a time. The chunk size is a multiple of
+	 * the key length, so the key index is the same as in buf. */
+	for (i = 0; i < info->len; i += len) {
+		len = info->len - i;
+		if (len > sizeof(chunk))
+			len = sizeof(chunk);
+
+		for (j = 0; j < len; j++)
+			chunk[j] = info->buf[i + j] ^ dev->xor_key[j % XOR_KEY_LEN];
+		crc = crc32(crc, chunk, len);
+	}
+
+	return crc;
+}
+
+/* Compute the CRC of an image once, for an image shared by many
+ * sessions */
+static void cache_content_crc(const struct device *dev,
+			      struct content *info)
+{
+	if (info->buf == NULL)
+		return;
+
+	info->crc = content_crc(dev, info);
+	info->crc_valid = true;
+}
+
+/* Parse hex bytes, optionally separated by ':' or '-'. Returns the
+ * number of bytes, or -1 if the string isn't valid. */
+static int parse_hex(const char *str, uint8_t *bytes, int max_len)
+{
+	unsigned int byte;
+	int len = 0;
+
+	if (strncmp(str, "0x", 2) == 0)
+		str += 2;
+
+	while (*str) {
+		if (*str == ':' || *str == '-') {
+			str++;
+			continue;
+		}
+
+		if (len == max_len || sscanf(str, "%2x", &byte) != 1 ||
+		    !isxdigit((unsigned char)str[1]))
+			return -1;
+
+		bytes[len++] = byte;
+		str += 2;
+	}
+
+	return len;
+}
+
+/* Load a data flash template. Each line is a field:
+ *
+ *   size 64                    rendered size, default is the last field end
+ *   fill 0xff                  value of the bytes not in a field
+ *   bytes 0x00 0102ab          constant bytes
+ *   id 0x08                    chip unique ID
+ *   mac 0x10 02:00:00          MAC, prefix + 3 bytes from the CRC of the ID
+ *   counter 0x20 4 serial.cnt  counter, incremented for each board
+ *   time 0x24                  seconds since the epoch
+ *   crc32 0x3c 0x00..0x3c      CRC of the range, end excluded
+ *
+ * The template is parsed once, before talking to the device. */
+static void load_template(struct data_template *tpl, char *filename)
+{
+	struct field *field;
+	size_t max_code_size;
+	size_t max_data_size;
+	char line[512];
+	char *token;
+	char *args[3];
+	unsigned long from;
+	unsigned long to;
+	char *end;
+	int n_args;
+	int lineno = 0;
+	int len;
+	FILE *f;
+
+	max_flash_sizes(&max_code_size, &max_data_size);
+
+	memset(tpl, 0, sizeof(*tpl));
+	tpl->filename = filename;
+	tpl->fill = 0xff;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't open the data template");
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		token = strchr(line, '#');
+		if (token)
+			*token = '\0';
+
+		token = strtok(line, " \t\r\n");
+		if (token == NULL)
+			continue;
+
+		for (n_args = 0; n_args < 3; n_args++) {
+			args[n_args] = strtok(NULL, " \t\r\n");
+			if (args[n_args] == NULL)
+				break;
+		}
+
+		if (strcmp(token, "size") == 0 && n_args == 1) {
+			tpl->size = strtoul(args[0], NULL, 0);
+			if (tpl->size > max_data_size)
+				errx(EXIT_FAILURE, "%s:%d: size is larger than the data flash",
+				     filename, lineno);
+			continue;
+		}
+
+		if (strcmp(token, "fill") == 0 && n_args == 1) {
+			tpl->fill = strtoul(args[0], NULL, 0);
+			continue;
+		}
+
+		tpl->fields = realloc(tpl->fields, (tpl->n + 1) * sizeof(*field));
+		if (tpl->fields == NULL)
+			errx(EXIT_FAILURE, "Can't allocate the data template");
+
+		field = &tpl->fields[tpl->n++];
+		memset(field, 0, sizeof(*field));
+
+		if (n_args >= 1)
+			field->offset = strtoul(args[0], NULL, 0);
+
+		if (strcmp(token, "bytes") == 0 && n_args == 2) {
+			field->type = FIELD_BYTES;
+			len = parse_hex(args[1], field->bytes, FIELD_MAX_BYTES);
+			if (len <= 0)
+				errx(EXIT_FAILURE, "%s:%d: invalid bytes '%s'",
+				     filename, lineno, args[1]);
+			field->len = len;
+		} else if (strcmp(token, "id") == 0 && n_args == 1) {
+			/* The real length depends on the chip */
+			field->type = FIELD_ID;
+			field->len = sizeof(((struct device *)0)->id);
+		} else if (strcmp(token, "mac") == 0 && n_args == 2) {
+			field->type = FIELD_MAC;
+			field->len = 6;
+			if (parse_hex(args[1], field->bytes, 3) != 3)
+				errx(EXIT_FAILURE, "%s:%d: invalid MAC prefix '%s'",
+				     filename, lineno, args[1]);
+		} else if (strcmp(token, "counter") == 0 && n_args == 3) {
+			field->type = FIELD_COUNTER;
+			field->len = strtoul(args[1], NULL, 0);
+			if (field->len < 1 || field->len > 8)
+				errx(EXIT_FAILURE, "%s:%d: counter size must be 1 to 8 bytes",
+				     filename, lineno);
+			field->counter_file = strdup(args[2]);
+		} else if (strcmp(token, "time") == 0 && n_args == 1) {
+			field->type = FIELD_TIME;
+			field->len = 4;
+		} else if (strcmp(token, "crc32") == 0 && n_args == 2) {
+			field->type = FIELD_CRC32;
+			field->len = 4;
+			from = strtoul(args[1], &end, 0);
+			to = 0;
+			if (end != args[1] && strncmp(end, "..", 2) == 0)
+				to = strtoul(end + 2, &end, 0);
+			if (*end || from > to || to > max_data_size)
+				errx(EXIT_FAILURE, "%s:%d: invalid CRC range '%s'",
+				     filename, lineno, args[1]);
+			field->from = from;
+			field->to = to;
+		} else {
+			errx(EXIT_FAILURE, "%s:%d: invalid template entry '%s'",
+			     filename, lineno, token);
+		}
+
+		if (field->offset + field->len > max_data_size)
+			errx(EXIT_FAILURE, "%s:%d: field is past the data flash",
+			     filename, lineno);
+	}
+
+	fclose(f);
+
+	if (tpl->n == 0)
+		errx(EXIT_FAILURE, "%s: template has no field", filename);
+}
+
+/* Take the next value of a counter. The file holds the value for the
+ * next board, in text. A value is never handed out twice, even if the
+ * session fails later. */
+static uint64_t next_counter(const char *filename)
+{
+	unsigned long long value = 0;
+	char text[32];
+	ssize_t ret;
+	int fd;
+
+	fd = open(filename, dry_run ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if (fd == -1 && dry_run && errno == ENOENT)
+		return 0;
+	if (fd == -1)
+		err(EXIT_FAILURE, "Can't open the counter file %s", filename);
+
+#ifndef WIN32
+	if (flock(fd, LOCK_EX) == -1)
+		err(EXIT_FAILURE, "Can't lock the counter file %s", filename);
+#endif
+
+	ret = read(fd, text, sizeof(text) - 1);
+	if (ret < 0)
+		err(EXIT_FAILURE, "Can't read the counter file %s", filename);
+	text[ret] = '\0';
+
+	if (ret > 0)
+		value = strtoull(text, NULL, 0);
+
+	if (dry_run) {
+		close(fd);
+		return value;
+	}
+
+	ret = snprintf(text, sizeof(text), "%llu\n", value + 1);
+	if (lseek(fd, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1 ||
+	    write(fd, text, ret) != ret)
+		err(EXIT_FAILURE, "Can't update the counter file %s", filename);
+
+	close(fd);
+
+	return value;
+}
+
+static void put_le(uint8_t *buf, uint64_t value, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = value >> (8 * i);
+}
+
+/* Render the template into the data to flash, for the current chip */
+static void render_template(struct device *dev, const struct data_template *tpl)
+{
+	const struct field *field;
+	struct content *info = &dev->data;
+	size_t max_len = dev->profile->data_flash_size;
+	size_t len = tpl->size;
+	uint32_t crc;
+	int i;
+	int j;
+
+	/* Fields may depend on the ID length, so size up first */
+	for (i = 0; i < tpl->n; i++) {
+		field = &tpl->fields[i];
+
+		if (field->type == FIELD_ID)
+			j = field->offset + dev->profile->mcu_id_len;
+		else
+			j = field->offset + field->len;
+
+		if (!tpl->size && j > len)
+			len = j;
+
+		if (j > max_len || (tpl->size && j > tpl->size))
+			errx(EXIT_FAILURE, "Data template field at 0x%x doesn't fit",
+			     field->offset);
+	}
+
+	if (!tpl->size)
+		len = (len + 7) & ~7;
+	if (len > max_len)
+		errx(EXIT_FAILURE, "Data template doesn't fit in the data flash");
+
+	if (info->buf == NULL) {
+		info->buf = malloc(max_len);
+		if (info->buf == NULL)
+			errx(EXIT_FAILURE, "Can't allocate %zu bytes for the data",
+			     max_len);
+	}
+
+	memset(info->buf, tpl->fill, len);
+	info->filename = tpl->filename;
+	info->len = len;
+	info->encrypted = false;
+
+	/* CRCs come last, so they cover the other fields */
+	for (i = 0; i < tpl->n; i++) {
+		field = &tpl->fields[i];
+
+		switch (field->type) {
+		case FIELD_BYTES:
+			memcpy(&info->buf[field->offset], field->bytes,
+			       field->len);
+			break;
+		case FIELD_ID:
+			memcpy(&info->buf[field->offset], dev->id,
+			       dev->profile->mcu_id_len);
+			break;
+		case FIELD_MAC:
+			crc = crc32(0, dev->id, dev->profile->mcu_id_len);
+			memcpy(&info->buf[field->offset], field->bytes, 3);
+			info->buf[field->offset + 3] = crc >> 16;
+			info->buf[field->offset + 4] = crc >> 8;
+			info->buf[field->offset + 5] = crc;
+			break;
+		case FIELD_COUNTER:
+			put_le(&info->buf[field->offset],
+			       next_counter(field->counter_file), field->len);
+			break;
+		case FIELD_TIME:
+			put_le(&info->buf[field->offset], time(NULL), 4);
+			break;
+		case FIELD_CRC32:
+			break;
+		}
+	}
+
+	for (i = 0; i < tpl->n; i++) {
+		field = &tpl->fields[i];
+
+		if (field->type != FIELD_CRC32)
+			continue;
+
+		if (field->to > len)
+			errx(EXIT_FAILURE, "Data template CRC range is past the data");
+
+		crc = crc32(0, &info->buf[field->from], field->to - field->from);
+		put_le(&info->buf[field->offset], crc, 4);
+	}
+
+	printf("Data rendered from %s:", tpl->filename);
+	for (i = 0; i < tpl->n; i++) {
+		static const char *field_names[] = {
+			"bytes", "id", "mac", "counter", "time", "crc32",
+		};
+		int field_len;
+
+		field = &tpl->fields[i];
+		field_len = field->type == FIELD_ID ?
+			dev->profile->mcu_id_len : field->len;
+
+		printf(" %s@0x%x=", field_names[field->type], field->offset);
+		for (j = 0; j < field_len; j++)
+			printf("%02x", info->buf[field->offset + j]);
+	}
+	printf("\n");
+}
+
+/* Parse a patch, OFFSET:WIDTH:SOURCE[:utf16] */
+static void parse_patch(struct patch *patch, char *spec)
+{
+	char *source;
+	char *end;
+
+	memset(patch, 0, sizeof(*patch));
+
+	patch->offset = strtoul(spec, &end, 0);
+	if (*end != ':')
+		errx(EXIT_FAILURE, "Invalid patch '%s'", spec);
+
+	patch->width = strtoul(end + 1, &end, 0);
+	if (*end != ':' || patch->width == 0)
+		errx(EXIT_FAILURE, "Invalid patch '%s'", spec);
+
+	source = end + 1;
+	end = strrchr(source, ':');
+	if (end && strcmp(end, ":utf16") == 0) {
+		patch->utf16 = true;
+		*end = '\0';
+	}
+
+	if (strncmp(source, "counter=", 8) == 0) {
+		patch->source = PATCH_COUNTER;
+		patch->filename = source + 8;
+		if (patch->width > 8)
+			errx(EXIT_FAILURE, "A counter is at most 8 bytes");
+	} else if (strncmp(source, "counter-str=", 12) == 0) {
+		patch->source = PATCH_COUNTER_STR;
+		patch->filename = source + 12;
+	} else if (strcmp(source, "id") == 0) {
+		patch->source = PATCH_ID;
+	} else if (strcmp(source, "id-str") == 0) {
+		patch->source = PATCH_ID_STR;
+	} else if (strncmp(source, "list=", 5) == 0) {
+		patch->source = PATCH_LIST;
+		patch->filename = source + 5;
+	} else {
+		errx(EXIT_FAILURE, "Invalid patch source '%s'", source);
+	}
+
+	if (patch->utf16 && (patch->source == PATCH_COUNTER ||
+			     patch->source == PATCH_ID))
+		errx(EXIT_FAILURE, "Only text patches can be in UTF-16");
+}
+
+/* Get line number index of a list, without its end of line */
+static bool read_list_entry(const char *filename, uint64_t index,
+			    char *line, size_t size)
+{
+	bool found = false;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't open the list %s", filename);
+
+	while (fgets(line, size, f)) {
+		if (index-- == 0) {
+			line[strcspn(line, "\r\n")] = '\0';
+			found = true;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return found;
+}
+
+/* Store some text in a patch value, padded with zeroes */
+static const char *put_text(uint8_t *value, const struct patch *patch,
+			    const char *text)
+{
+	size_t len = strlen(text);
+	size_t i;
+
+	if (len * (patch->utf16 ? 2 : 1) > patch->width)
+		return "patch value is too long";
+
+	memset(value, 0, patch->width);
+	for (i = 0; i < len; i++) {
+		if (patch->utf16)
+			value[i * 2] = text[i];
+		else
+			value[i] = text[i];
+	}
+
+	return NULL;
+}
+
+/* Render the patch values for a device, once its ID is known.
+ * Returns an error message, or NULL. */
+static const char *render_patches(struct device *dev)
+{
+	const struct patch *patch;
+	char text[256];
+	char list_counter[512];
+	const char *error = NULL;
+	uint8_t *value;
+	size_t total = 0;
+	uint64_t n;
+	int digits;
+	int i;
+	int j;
+
+	for (i = 0; i < dev->n_patches; i++)
+		total += dev->patches[i].width;
+
+	dev->patch_values = malloc(total);
+	if (dev->patch_values == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the patches");
+
+	value = dev->patch_values;
+	for (i = 0; i < dev->n_patches && !error; value += patch->width, i++) {
+		patch = &dev->patches[i];
+
+		switch (patch->source) {
+		case PATCH_COUNTER:
+			put_le(value, next_counter(patch->filename),
+			       patch->width);
+			break;
+
+		case PATCH_COUNTER_STR:
+			digits = patch->utf16 ? patch->width / 2 : patch->width;
+			if (digits > 20)
+				digits = 20;
+			snprintf(text, sizeof(text), "%0*llu", digits,
+				 (unsigned long long)next_counter(patch->filename));
+			error = put_text(value, patch, text);
+			break;
+
+		case PATCH_ID:
+			if (patch->width < dev->profile->mcu_id_len) {
+				error = "patch is smaller than the chip ID";
+				break;
+			}
+
+			memset(value, 0, patch->width);
+			memcpy(value, dev->id, dev->profile->mcu_id_len);
+			break;
+
+		case PATCH_ID_STR:
+			for (j = 0; j < dev->profile->mcu_id_len; j++)
+				sprintf(&text[j * 2], "%02X", dev->id[j]);
+			error = put_text(value, patch, text);
+			break;
+
+		case PATCH_LIST:
+			/* The index of the next entry is kept beside the list */
+			snprintf(list_counter, sizeof(list_counter), "%s.next",
+				 patch->filename);
+			n = next_counter(list_counter);
+			if (!read_list_entry(patch->filename, n, text, sizeof(text)))
+				error = "patch list is exhausted";
+			else
+				error = put_text(value, patch, text);
+			break;
+		}
+	}
+
+	return error;
+}
+
+static void print_patches(const struct device *dev)
+{
+	const uint8_t *value = dev->patch_values;
+	const struct patch *patch;
+	int i;
+	int j;
+
+	printf("Patched firmware:");
+	for (i = 0; i < dev->n_patches; value += patch->width, i++) {
+		patch = &dev->patches[i];
+
+		printf(" 0x%x=", patch->offset);
+		for (j = 0; j < patch->width; j++)
+			printf("%02x", value[j]);
+	}
+	printf("\n");
+}
+
+#ifndef WIN32
+/* Flight recorder. Records are appended to a memory mapped file
+ * without locks: a slot is reserved by atomically bumping the header
+ * counter, filled, then chained to its chip ID bucket with a
+ * compare and swap. Records are ordered by reservation. The end time
+ * is read right before reserving, so the records are in end time
+ * order, except for sessions ending within a few microseconds of each
+ * other, and time ranges can be found with a binary search. */
+
+static unsigned int id_bucket(const uint8_t *id, int id_len)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < id_len; i++)
+		hash = (hash ^ id[i]) * 16777619u;
+
+	return hash % REC_BUCKETS;
+}
+
+/* Map a flight recorder file, creating it if needed */
+static void open_recorder(struct recorder *rec, const char *filename)
+{
+	struct rec_header hdr = {
+		.magic = REC_MAGIC,
+		.version = 1,
+		.record_size = sizeof(struct flight_record),
+		.capacity = REC_DEFAULT_CAPACITY,
+	};
+	struct stat statbuf;
+	int fd;
+
+	fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Can't open the flight recorder '%s'", filename);
+
+	/* Only the creation is serialized between sessions */
+	if (flock(fd, LOCK_EX) == -1)
+		err(EXIT_FAILURE, "Can't lock the flight recorder");
+
+	if (fstat(fd, &statbuf) == -1)
+		err(EXIT_FAILURE, "Can't get the flight recorder size");
+
+	if (statbuf.st_size == 0) {
+		if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+			err(EXIT_FAILURE, "Can't initialize the flight recorder");
+
+		if (ftruncate(fd, sizeof(hdr) +
+			      hdr.capacity * sizeof(struct flight_record)) == -1)
+			err(EXIT_FAILURE, "Can't size the flight recorder");
+
+		if (fstat(fd, &statbuf) == -1)
+			err(EXIT_FAILURE, "Can't get the flight recorder size");
+	}
+
+	flock(fd, LOCK_UN);
+
+	rec->map_len = statbuf.st_size;
+	rec->hdr = mmap(NULL, rec->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (rec->hdr == MAP_FAILED)
+		err(EXIT_FAILURE, "Can't map the flight recorder");
+
+	close(fd);
+
+	if (memcmp(rec->hdr->magic, REC_MAGIC, sizeof(rec->hdr->magic)) != 0 ||
+	    rec->hdr->record_size != sizeof(struct flight_record) ||
+	    rec->map_len < sizeof(struct rec_header) +
+	    rec->hdr->capacity * sizeof(struct flight_record))
+		errx(EXIT_FAILURE, "'%s' is not a valid flight recorder", filename);
+
+	rec->records = (struct flight_record *)(rec->hdr + 1);
+}
+
+static void copy_name(char *dst, size_t size, const char *src)
+{
+	const char *base;
+
+	if (src == NULL)
+		return;
+
+	base = strrchr(src, '/');
+	strncpy(dst, base ? base + 1 : src, size - 1);
+}
+
+/* Append the session of a device to the recorder */
+static void record_session(struct recorder *rec, const struct device *dev,
+			   int result)
+{
+	struct flight_record *r;
+	uint64_t *bucket;
+	uint64_t index;
+	uint64_t head;
+	uintptr_t page;
+	int64_t end_us;
+
+	/* Right before the reservation, to keep the records in order */
+	end_us = wall_clock_us();
+	index = __atomic_fetch_add(&rec->hdr->next, 1, __ATOMIC_RELAXED);
+	if (index >= rec->hdr->capacity) {
+		fprintf(stderr, "Flight recorder is full\n");
+		return;
+	}
+
+	r = &rec->records[index];
+	memset(r, 0, sizeof(*r));
+
+	r->start_us = dev->start_us;
+	r->end_us = end_us;
+	r->result = result;
+	r->last_step = dev->step < 0 ? 0xff : dev->step;
+	r->identify_ms = dev->identify_ms;
+	memcpy(r->step_ms, dev->step_ms, sizeof(r->step_ms));
+
+	if (dev->profile) {
+		r->id_len = dev->profile->mcu_id_len;
+		memcpy(r->id, dev->id, r->id_len);
+		r->family = dev->profile->family;
+		r->type = dev->profile->type;
+		copy_name(r->chip, sizeof(r->chip), dev->profile->name);
+	}
+
+	r->bv = dev->bv;
+	memcpy(r->config_before, dev->config_data, sizeof(r->config_before));
+	memcpy(r->config_after,
+	       dev->config_written ? dev->config_after : dev->config_data,
+	       sizeof(r->config_after));
+
+	if (dev->fw.buf) {
+		copy_name(r->code_image, sizeof(r->code_image), dev->fw.filename);
+		r->code_crc = content_crc(dev, &dev->fw);
+		r->code_len = dev->fw.len;
+	}
+
+	if (dev->data.buf) {
+		copy_name(r->data_image, sizeof(r->data_image), dev->data.filename);
+		r->data_crc = content_crc(dev, &dev->data);
+		r->data_len = dev->data.len;
+	}
+
+	/* Publish the record in its bucket, then mark it complete */
+	bucket = &rec->hdr->buckets[id_bucket(r->id, r->id_len)];
+	head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	do {
+		r->prev = head;
+	} while (!__atomic_compare_exchange_n(bucket, &head, index + 1, false,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_ACQUIRE));
+
+	__atomic_store_n(&r->committed, 1, __ATOMIC_RELEASE);
+
+	/* Start writing it back without waiting for it */
+	page = (uintptr_t)r & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+	msync((void *)page, (uintptr_t)(r + 1) - page, MS_ASYNC);
+}
+
+static void print_record(const struct flight_record *r)
+{
+	int i;
+
+	printf("%lld.%06lld ", (long long)(r->end_us / 1000000),
+	       (long long)(r->end_us % 1000000));
+
+	for (i = 0; i < r->id_len; i++)
+		printf("%s%02x", i ? "-" : "", r->id[i]);
+
+	printf(" %s %d.%d.%d %s", r->chip[0] ? r->chip : "?",
+	       (r->bv >> 16) & 0xff, (r->bv >> 8) & 0xff, r->bv & 0xff,
+	       r->result ? "failed" : "ok");
+
+	if (r->result && r->last_step < N_STEPS)
+		printf(" in %s", step_names[r->last_step]);
+
+	if (r->code_image[0])
+		printf(" code=%s/%08x/%u", r->code_image, r->code_crc, r->code_len);
+	if (r->data_image[0])
+		printf(" data=%s/%08x/%u", r->data_image, r->data_crc, r->data_len);
+
+	printf(" config=");
+	for (i = 0; i < sizeof(r->config_before); i++)
+		printf("%02x", r->config_before[i]);
+	if (memcmp(r->config_before, r->config_after,
+		   sizeof(r->config_before)) != 0) {
+		printf("->");
+		for (i = 0; i < sizeof(r->config_after); i++)
+			printf("%02x", r->config_after[i]);
+	}
+
+	printf(" identify=%.1fms", r->identify_ms);
+	for (i = 0; i < N_STEPS; i++) {
+		if (r->step_ms[i] > 0)
+			printf(" %s=%.1fms", step_names[i], r->step_ms[i]);
+	}
+
+	printf("\n");
+}
+
+/* Print the records for a chip ID, or a time range. */
+static void query_recorder(struct recorder *rec, char *query)
+{
+	const struct flight_record *r;
+	uint64_t count = rec->hdr->next;
+	uint8_t id[8];
+	int id_len;
+	uint64_t index;
+
+	if (count > rec->hdr->capacity)
+		count = rec->hdr->capacity;
+
+	if (strncmp(query, "id=", 3) == 0) {
+		id_len = parse_chip_id(query + 3, id);
+
+		/* Walk the chain of that ID bucket, newest first */
+		index = __atomic_load_n(&rec->hdr->buckets[id_bucket(id, id_len)],
+					__ATOMIC_ACQUIRE);
+		while (index) {
+			r = &rec->records[index - 1];
+			if (r->committed && r->id_len == id_len &&
+			    memcmp(r->id, id, id_len) == 0)
+				print_record(r);
+			index = r->prev;
+		}
+	} else if (strncmp(query, "time=", 5) == 0) {
+		int64_t from;
+		int64_t to;
+		uint64_t lo = 0;
+		uint64_t hi = count;
+		char *end;
+
+		from = strtoll(query + 5, &end, 0) * 1000000;
+		if (strncmp(end, "..", 2) != 0)
+			errx(EXIT_FAILURE, "Invalid time range '%s'", query + 5);
+		to = end[2] ? strtoll(end + 2, NULL, 0) * 1000000 : INT64_MAX;
+
+		/* First record ending after from. Uncommitted records
+		 * are skipped by looking at the next ones. */
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			uint64_t i = mid;
+
+			while (i < hi && !rec->records[i].committed)
+				i++;
+
+			if (i < hi && rec->records[i].end_us < from)
+				lo = i + 1;
+			else
+				hi = mid;
+		}
+
+		for (index = lo; index < count; index++) {
+			r = &rec->records[index];
+			if (!r->committed)
+				continue;
+			if (r->end_us > to)
+				break;
+			print_record(r);
+		}
+	} else {
+		errx(EXIT_FAILURE, "Invalid query '%s'", query);
+	}
+}
+#endif
+
+#ifndef WIN32
+/* Several devices at once. Each session runs in its own process, so
+ * a failure only ends that session. Prepared images are shared with
+ * the parent, copy on write. The output of a session is captured and
+ * printed once it is over, so the sessions don't mix their lines. */
+
+static void open_location(struct device *dev, const struct location *loc)
+{
+	if (loc->port)
+		open_serial_device(dev, (char *)loc->port);
+	else
+		open_usb_device_at(dev, loc);
+}
+
+/* Print a string in JSON, with its quotes */
+static void print_json_string(FILE *f, const char *str)
+{
+	char escaped[JSON_ESCAPE_MAX];
+
+	fputc('"', f);
+	for (; *str; str++)
+		fwrite(escaped, 1, json_escape(escaped, *str), f);
+	fputc('"', f);
+}
+
+/* Start a process per session. Returns the session index in the
+ * child, with its output redirected, or -1 in the parent. */
+static int fork_sessions(struct sessions *ss, int n)
+{
+	int pipe_fds[2];
+	int i;
+
+	ss->n = n;
+	ss->pids = calloc(n, sizeof(*ss->pids));
+	ss->fds = calloc(n, sizeof(*ss->fds));
+	if (ss->pids == NULL || ss->fds == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the sessions");
+
+	fflush(stdout);
+
+	/* Wait for the sessions to stop by themselves on a signal */
+	session_pids = ss->pids;
+	sessions_running = true;
+
+	for (i = 0; i < n; i++) {
+		if (pipe(pipe_fds) == -1)
+			err(EXIT_FAILURE, "Can't create a pipe");
+
+		ss->pids[i] = fork();
+		if (ss->pids[i] == -1)
+			err(EXIT_FAILURE, "Can't start a session");
+
+		if (ss->pids[i] == 0) {
+			n_session_pids = 0;
+			sessions_running = false;
+			close(pipe_fds[0]);
+			dup2(pipe_fds[1], STDOUT_FILENO);
+			dup2(pipe_fds[1], STDERR_FILENO);
+			close(pipe_fds[1]);
+
+			return i;
+		}
+
+		close(pipe_fds[1]);
+		ss->fds[i] = pipe_fds[0];
+		n_session_pids = i + 1;
+	}
+
+	return -1;
+}
+
+/* Wait for the sessions, and print their output with print_output.
+ * Returns the number of sessions which failed. */
+static int collect_sessions(struct sessions *ss, const struct location *locs,
+			    void (*print_output)(const struct location *loc,
+						 bool ok, char *output))
+{
+	char *output;
+	size_t output_len;
+	ssize_t ret;
+	int status;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < ss->n; i++) {
+		output = NULL;
+		output_len = 0;
+
+		do {
+			output = realloc(output, output_len + 4096 + 1);
+			if (output == NULL)
+				errx(EXIT_FAILURE, "Can't allocate the session output");
+
+			ret = read(ss->fds[i], output + output_len, 4096);
+			if (ret > 0)
+				output_len += ret;
+		} while (ret > 0 || (ret < 0 && errno == EINTR));
+
+		output[output_len] = '\0';
+		close(ss->fds[i]);
+
+		while (waitpid(ss->pids[i], &status, 0) == -1 && errno == EINTR)
+			;
+		ss->pids[i] = -1;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			failed++;
+
+		print_output(&locs[i], WIFEXITED(status) &&
+			     WEXITSTATUS(status) == EXIT_SUCCESS, output);
+
+		free(output);
+	}
+
+	n_session_pids = 0;
+	sessions_running = false;
+	free(ss->pids);
+	free(ss->fds);
+
+	return failed;
+}
+
+/* Run a session on each location, in parallel. The session output
+ * is printed with print_output, as each one completes. Returns the
+ * number of sessions which failed. */
+static int run_sessions(struct device *tmpl, const struct location *locs,
+			int n, void (*session)(struct device *dev,
+					       const struct location *loc),
+			void (*print_output)(const struct location *loc,
+					     bool ok, char *output))
+{
+	struct sessions ss;
+	int i;
+
+	i = fork_sessions(&ss, n);
+	if (i >= 0) {
+		struct device dev = *tmpl;
+
+		dev.session_start = now_ms();
+		sessions_running = true;
+		session(&dev, &locs[i]);
+
+		exit(EXIT_SUCCESS);
+	}
+
+	return collect_sessions(&ss, locs, print_output);
+}
+
+/* Identify one device for the inventory, and print it in JSON */
+static void scan_session(struct device *dev, const struct location *loc)
+{
+	bool supported;
+	int i;
+
+	open_location(dev, loc);
+	read_chip_type(dev);
+	read_config(dev);
+	supported = set_bootloader_quirks(dev);
+
+	printf("{\"location\": ");
+	print_json_string(stdout, loc->name);
+	printf(", \"name\": ");
+	print_json_string(stdout, dev->profile->name);
+	printf(", \"family\": %u, \"type\": %u", dev->profile->family,
+	       dev->profile->type);
+	printf(", \"bootloader\": \"%d.%d.%d\"", (dev->bv >> 16) & 0xff,
+	       (dev->bv >> 8) & 0xff, dev->bv & 0xff);
+
+	printf(", \"id\": \"");
+	for (i = 0; i < dev->profile->mcu_id_len; i++)
+		printf("%s%02x", i ? "-" : "", dev->id[i]);
+
+	printf("\", \"config\": \"");
+	for (i = 0; i < sizeof(dev->config_data); i++)
+		printf("%02x", dev->config_data[i]);
+
+	printf("\", \"supported\": %s}\n", supported ? "true" : "false");
+}
+
+static void print_scan_output(const struct location *loc, bool ok,
+			      char *output)
+{
+	char *p;
+
+	if (ok) {
+		fputs(output, stdout);
+		return;
+	}
+
+	/* Keep the last error message, without the program name */
+	p = output + strlen(output);
+	while (p > output && p[-1] == '\n')
+		*--p = '\0';
+	p = strrchr(output, '\n');
+	p = p ? p + 1 : output;
+	if (strncmp(p, "isp55e0: ", 9) == 0)
+		p += 9;
+
+	printf("{\"location\": ");
+	print_json_string(stdout, loc->name);
+	printf(", \"error\": ");
+	print_json_string(stdout, *p ? p : "session failed");
+	printf("}\n");
+}
+
+/* Inventory of all the devices in ISP mode, and of the given serial
+ * ports. Returns the process exit code. */
+static int scan_devices(struct device *tmpl, char **ports, int n_ports)
+{
+	struct location *locs;
+	int n;
+	int i;
+
+	n = enumerate_usb_devices(&locs);
+
+	locs = realloc(locs, (n + n_ports) * sizeof(*locs));
+	if (locs == NULL && n + n_ports)
+		errx(EXIT_FAILURE, "Can't allocate the device list");
+
+	for (i = 0; i < n_ports; i++) {
+		memset(&locs[n], 0, sizeof(locs[n]));
+		locs[n].port = ports[i];
+		snprintf(locs[n].name, sizeof(locs[n].name), "%s", ports[i]);
+		n++;
+	}
+
+	run_sessions(tmpl, locs, n, scan_session, print_scan_output);
+
+	free(locs);
+
+	return EXIT_SUCCESS;
+}
+
+/* Parse the answer to the chip type probe, once it is complete */
+static bool probe_answered(struct probe *p)
+{
+	const struct resp_chip_type *resp = (const void *)&p->rx[2];
+
+	if (p->rx_len < sizeof(p->rx))
+		return false;
+
+	if (p->rx[0] == SERIAL_RESP_MAGIC1 && p->rx[1] == SERIAL_RESP_MAGIC2 &&
+	    p->rx[sizeof(p->rx) - 1] == serial_crc(&p->rx[2], sizeof(*resp)) &&
+	    resp->hdr.command == CMD_CHIP_TYPE)
+		p->profile = find_profile(resp->family, resp->type);
+
+	return true;
+}
+
+/* Probe the serial ports matching some comma separated patterns, all
+ * at once, and add the ones with a bootloader to ports. Returns the
+ * number of ports added. */
+static int discover_serial_ports(const char *patterns, unsigned int timeout_ms,
+				 char **ports, int max_ports)
+{
+	struct req_get_chip_type req = {
+		.hdr.command = CMD_CHIP_TYPE,
+		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+		.string = "MCU ISP & WCH.CN",
+	};
+	uint8_t frame[sizeof(req) + 3];
+	struct pollfd *pfds;
+	struct probe *probes;
+	struct probe *p;
+	glob_t g = {};
+	char *list;
+	char *pattern;
+	double deadline;
+	int frame_len;
+	int n = 0;
+	int found = 0;
+	int pending;
+	int flags = 0;
+	size_t i;
+	int j;
+	ssize_t ret;
+
+	list = strdup(patterns);
+	for (pattern = strtok(list, ","); pattern; pattern = strtok(NULL, ",")) {
+		glob(pattern, flags, NULL, &g);
+		flags = GLOB_APPEND;
+	}
+	free(list);
+
+	probes = calloc(g.gl_pathc + 1, sizeof(*probes));
+	pfds = calloc(g.gl_pathc + 1, sizeof(*pfds));
+	if (probes == NULL || pfds == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the serial probes");
+
+	frame_len = serial_frame(frame, &req, sizeof(req));
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		p = &probes[n];
+		p->real = realpath(g.gl_pathv[i], NULL);
+		if (p->real == NULL)
+			continue;
+
+		for (j = 0; j < n; j++) {
+			if (strcmp(probes[j].real, p->real) == 0)
+				break;
+		}
+		if (j < n) {
+			free(p->real);
+			continue;
+		}
+
+		p->fd = open(g.gl_pathv[i], O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (p->fd == -1) {
+			free(p->real);
+			continue;
+		}
+
+		if (setup_serial_port(p->fd) < 0) {
+			close(p->fd);
+			free(p->real);
+			continue;
+		}
+
+		tcflush(p->fd, TCIOFLUSH);
+		if (write(p->fd, frame, frame_len) != frame_len) {
+			close(p->fd);
+			free(p->real);
+			continue;
+		}
+
+		p->port = strdup(g.gl_pathv[i]);
+		pfds[n].fd = p->fd;
+		pfds[n].events = POLLIN;
+		n++;
+	}
+
+	globfree(&g);
+
+	/* All the probes share the same deadline */
+	deadline = now_ms() + timeout_ms;
+	pending = n;
+	while (pending) {
+		double left = deadline - now_ms();
+
+		if (left <= 0)
+			break;
+
+		if (poll(pfds, n, left + 1) == -1 && errno != EINTR)
+			err(EXIT_FAILURE, "Can't wait for the serial ports");
+
+		for (j = 0; j < n; j++) {
+			p = &probes[j];
+
+			if (!(pfds[j].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+
+			ret = read(p->fd, &p->rx[p->rx_len],
+				   sizeof(p->rx) - p->rx_len);
+			if (ret > 0)
+				p->rx_len += ret;
+
+			/* Skip leading garbage */
+			while (p->rx_len && p->rx[0] != SERIAL_RESP_MAGIC1)
+				memmove(p->rx, p->rx + 1, --p->rx_len);
+
+			if (ret <= 0 || probe_answered(p)) {
+				pfds[j].fd = -1;
+				pending--;
+			}
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		p = &probes[j];
+
+		close(p->fd);
+
+		if (p->profile == NULL) {
+			free(p->port);
+			free(p->real);
+			continue;
+		}
+
+		printf("Found %s on %s", p->profile->name, p->port);
+		if (strcmp(p->port, p->real) != 0)
+			printf(" (%s)", p->real);
+		printf("\n");
+		free(p->real);
+
+		if (found == max_ports)
+			errx(EXIT_FAILURE, "Too many serial ports");
+		ports[found++] = p->port;
+	}
+
+	free(probes);
+	free(pfds);
+
+	return found;
+}
+#endif
+
+#ifdef __linux__
+static void print_gang_output(const struct location *loc, bool ok,
+			      char *output)
+{
+	printf("== %s (TT %s): %s ==\n", loc->name, loc->group,
+	       ok ? "done" : "FAILED");
+	fputs(output, stdout);
+}
+
+/* Start a session for each device in ISP mode on USB. The sessions
+ * are grouped by transaction translator, and share the transfer slots
+ * of their group. Returns the location of the device in the sessions,
+ * while the parent waits for them all and exits. */
+static const struct location *start_gang(struct device *dev)
+{
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	struct location *locs;
+	struct gang_group *g;
+	struct sessions ss;
+	struct gang *gang;
+	int failed;
+	int n;
+	int i;
+	int j;
+
+	n = enumerate_usb_devices(&locs);
+	if (n == 0)
+		errx(EXIT_FAILURE, "No device in ISP mode found");
+	if (n > MAX_PORTS)
+		errx(EXIT_FAILURE, "Too many devices for a gang (max %d)",
+		     MAX_PORTS);
+
+	gang = mmap(NULL, sizeof(*gang), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (gang == MAP_FAILED)
+		err(EXIT_FAILURE, "Can't map the gang state");
+
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < gang->n_groups; j++)
+			if (strcmp(gang->groups[j].name, locs[i].group) == 0)
+				break;
+
+		g = &gang->groups[j];
+		if (j == gang->n_groups) {
+			pthread_mutex_init(&g->lock, &mutex_attr);
+			pthread_cond_init(&g->cond, &cond_attr);
+			snprintf(g->name, sizeof(g->name), "%s", locs[i].group);
+			g->direction = -1;
+			gang->n_groups++;
+		}
+
+		g->members++;
+		gang->members[i].group = j;
+		pthread_mutex_init(&gang->members[i].alive, &mutex_attr);
+	}
+	gang->n_members = n;
+
+	/* Start with no limit, and let the tuning lower it */
+	for (j = 0; j < gang->n_groups; j++) {
+		g = &gang->groups[j];
+		g->limit = g->min_limit = g->max_limit = g->members;
+		g->window_ms = now_ms();
+	}
+
+	pthread_mutexattr_destroy(&mutex_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	i = fork_sessions(&ss, n);
+	if (i >= 0) {
+		pthread_mutex_lock(&gang->members[i].alive);
+		dev->gang = gang;
+		dev->gang_member = i;
+
+		return &locs[i];
+	}
+
+	failed = collect_sessions(&ss, locs, print_gang_output);
+
+	for (j = 0; j < gang->n_groups; j++) {
+		g = &gang->groups[j];
+		printf("TT %s: %d device%s, %d to %d transfers in flight\n",
+		       g->name, g->members, g->members > 1 ? "s" : "",
+		       g->min_limit, g->max_limit);
+	}
+	printf("%d of %d devices flashed\n", n - failed, n);
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Watch mode. The firmware file is watched through its directory, as
+ * the build tools often replace the file rather than write it. Once
+ * the writes settle, the firmware is reloaded and flashed again: in
+ * the same session if the bootloader still answers, or once the device
+ * is back in ISP mode. */
+
+/* Wait for a change to the file, then for the writes to settle */
+static void wait_for_change(int fd, const char *name)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	while (1) {
+		if (poll(&pfd, 1, changed ? WATCH_SETTLE_MS : -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "Can't watch the firmware");
+		}
+
+		/* Nothing happened to it for a while */
+		if (!(pfd.revents & POLLIN))
+			return;
+
+		len = read(fd, buf, sizeof(buf));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			err(EXIT_FAILURE, "Can't watch the firmware");
+
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if (event->len && strcmp(event->name, name) == 0)
+				changed = true;
+		}
+	}
+}
+
+/* Close the device, and wait for it to be back in ISP mode */
+static void reopen_device(struct device *dev, char *port)
+{
+	struct resp_chip_type resp;
+	struct location *locs;
+	const char *reason;
+	int n;
+
+	if (dev->usb_h) {
+		libusb_release_interface(dev->usb_h, 0);
+		libusb_close(dev->usb_h);
+		libusb_exit(NULL);
+		dev->usb_h = NULL;
+	} else if (dev->fd) {
+		close(dev->fd);
+		dev->fd = 0;
+	}
+
+	printf("Waiting for the device in ISP mode\n");
+	fflush(stdout);
+
+	while (1) {
+		if (port) {
+			open_serial_device(dev, port);
+
+			if (dev->enter_seq) {
+				enter_bootloader(dev);
+				return;
+			}
+
+			if (request_chip_type(dev, &resp) == 0)
+				return;
+
+			close(dev->fd);
+			dev->fd = 0;
+		} else {
+			/* Nothing is sent there, which would see the stop */
+			reason = session_stop_reason(dev);
+			if (reason)
+				errx(EXIT_FAILURE, "Session %s while waiting for the device",
+				     reason);
+
+			n = enumerate_usb_devices(&locs);
+			if (n)
+				open_usb_device_at(dev, &locs[0]);
+			free(locs);
+
+			if (n)
+				return;
+		}
+
+		usleep(WATCH_POLL_MS * 1000);
+	}
+}
+
+/* Flash the firmware again each time it changes. Doesn't return. As
+ * the erase always starts at the beginning of the code flash, the
+ * whole firmware is flashed every time, not only what changed. */
+static void watch_firmware(struct device *dev, const struct session_ops *ops,
+			   char *port)
+{
+	struct resp_chip_type resp;
+	struct plan plan;
+	char *dir = strdup(dev->fw.filename);
+	char *name = strdup(dev->fw.filename);
+	uint32_t crc;
+	size_t len;
+	double start;
+	int fd;
+
+	if (dir == NULL || name == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the firmware name");
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1 ||
+	    inotify_add_watch(fd, dirname(dir), IN_MODIFY | IN_CLOSE_WRITE |
+			      IN_CREATE | IN_MOVED_TO) == -1)
+		err(EXIT_FAILURE, "Can't watch '%s'", dev->fw.filename);
+	name = basename(name);
+
+	/* The firmware was encrypted with the key of that chip */
+	crc = content_crc(dev, &dev->fw);
+	len = dev->fw.len;
+
+	while (1) {
+		printf("Watching %s\n", dev->fw.filename);
+		fflush(stdout);
+
+		wait_for_change(fd, name);
+		start = now_ms();
+		dev->session_start = start;
+
+		if (access(dev->fw.filename, R_OK) == -1) {
+			printf("Firmware is gone\n");
+			continue;
+		}
+
+		free(dev->fw.buf);
+		dev->fw.buf = NULL;
+		dev->fw.encrypted = false;
+		open_content(&dev->fw);
+		load_file(dev, &dev->fw);
+
+		if (dev->fw.len == len && content_crc(dev, &dev->fw) == crc) {
+			printf("Firmware is unchanged\n");
+			continue;
+		}
+
+		/* A signal now stops the session between two commands */
+		sessions_running = true;
+
+		/* The application runs once flashed, so the device is
+		 * usually gone. Otherwise the identification, the
+		 * configuration and the key are still good. */
+		if (request_chip_type(dev, &resp)) {
+			reopen_device(dev, port);
+			read_chip_type(dev);
+			read_config(dev);
+			if (!set_bootloader_quirks(dev))
+				errx(EXIT_FAILURE, "This bootloader version is not supported");
+			create_key(dev);
+		} else if (dev->config_written) {
+			memcpy(dev->config_data, dev->config_after,
+			       sizeof(dev->config_data));
+		}
+
+		crc = content_crc(dev, &dev->fw);
+		len = dev->fw.len;
+		encrypt_or_decrypt(dev, &dev->fw);
+
+		plan_session(dev, ops, &plan);
+		run_plan(dev, &plan);
+		sessions_running = false;
+
+		printf("Reflashed in %.1f ms\n", now_ms() - start);
+	}
+}
+
+/* Many serial ports at once, driven by a single thread. Each board
+ * is a state machine, which moves on when its response frame has
+ * arrived. Images are shared and encrypted a chunk at a time. */
+
+static const char *board_state_names[] = {
+	[BOARD_CHIP_TYPE] = "chip type",
+	[BOARD_READ_CONFIG] = "read config",
+	[BOARD_SET_KEY] = "set key",
+	[BOARD_WRITE_CONFIG] = "write config",
+	[BOARD_ERASE] = "erase",
+	[BOARD_WRITE] = "write",
+	[BOARD_LAST_WRITE] = "last write",
+	[BOARD_VERIFY_KEY] = "set key",
+	[BOARD_VERIFY] = "verify",
+	[BOARD_REBOOT] = "reboot",
+	[BOARD_DONE] = "done",
+	[BOARD_FAILED] = "failed",
+};
+
+/* Stop watching a board which is over, and close its port, so that
+ * a port in error doesn't keep waking up the loop */
+static void board_close(struct board *b)
+{
+	struct itimerspec off = {};
+
+	timerfd_settime(b->timer_fd, 0, &off, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &b->end);
+
+	if (b->dev.fd < 0)
+		return;
+
+	epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, b->dev.fd, NULL);
+	close(b->dev.fd);
+	b->dev.fd = -1;
+}
+
+static void board_fail(struct board *b, const char *error)
+{
+	b->error = error;
+	b->failed_state = b->state;
+	b->state = BOARD_FAILED;
+	progress(&b->dev.progress, board_state_names[BOARD_FAILED], b->offset,
+		 b->image ? b->image->len : 0);
+	board_close(b);
+}
+
+static void board_done(struct board *b)
+{
+	b->state = BOARD_DONE;
+	progress(&b->dev.progress, board_state_names[BOARD_DONE], b->offset,
+		 b->image ? b->image->len : 0);
+	board_close(b);
+}
+
+/* Write what is left of the request frame. If the port can't take
+ * it all, the rest goes out when the port is writable again. */
+static void board_flush(struct board *b)
+{
+	struct epoll_event ev = {
+		.data.u32 = b->index * 2,
+	};
+	ssize_t ret;
+
+	ret = write(b->dev.fd, &b->tx[b->tx_off], b->tx_len - b->tx_off);
+	if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+		board_fail(b, "write error");
+		return;
+	}
+	if (ret > 0)
+		b->tx_off += ret;
+
+	if (b->tx_off < b->tx_len && !b->tx_waiting) {
+		ev.events = EPOLLIN | EPOLLOUT;
+		b->tx_waiting = true;
+	} else if (b->tx_off == b->tx_len && b->tx_waiting) {
+		ev.events = EPOLLIN;
+		b->tx_waiting = false;
+	} else {
+		return;
+	}
+
+	if (epoll_ctl(b->epoll_fd, EPOLL_CTL_MOD, b->dev.fd, &ev) == -1)
+		board_fail(b, "can't watch the port");
+}
+
+static void board_arm_timer(struct board *b, unsigned int ms)
+{
+	struct itimerspec timeout = {
+		.it_value.tv_sec = ms / 1000,
+		.it_value.tv_nsec = (ms % 1000) * 1000000,
+	};
+
+	timerfd_settime(b->timer_fd, 0, &timeout, NULL);
+}
+
+/* Write the request frame again, or for the first time */
+static void board_transmit(struct board *b)
+{
+	const void *req = &b->tx[2];
+
+	if (b->dev.faults)
+		b->dev.faults->transfers++;
+
+	b->sent_ms = now_ms();
+	b->rx_len = 0;
+	board_arm_timer(b, command_timeout(&b->dev, req));
+
+	b->tx_off = 0;
+	board_flush(b);
+}
+
+/* Send a request and arm the board timer */
+static void board_send(struct board *b, const void *req, int req_len,
+		       int resp_len)
+{
+	b->cmd = ((const struct req_hdr *)req)->command;
+	b->req_len = req_len;
+	b->tries = command_is_idempotent(b->cmd) ? b->dev.retries : 0;
+
+	if (b->dev.debug)
+		hexdump(b->port, req, req_len);
+
+	b->resp_len = resp_len + 3;
+	b->tx_len = serial_frame(b->tx, req, req_len);
+	board_transmit(b);
+}
+
+/* The response is lost or bad. Send the command again if it can be
+ * repeated, once the late data has stopped coming, or give up. */
+static void board_retry(struct board *b, const char *error)
+{
+	record_error(&b->dev, b->cmd);
+
+	if (b->tries-- == 0) {
+		board_fail(b, error);
+		return;
+	}
+
+	if (b->dev.debug)
+		printf("%s: %s, retrying command 0x%02x\n", b->port, error,
+		       b->cmd);
+	if (b->dev.faults)
+		b->dev.faults->retried++;
+
+	tcflush(b->dev.fd, TCIFLUSH);
+	b->draining = true;
+	board_arm_timer(b, DRAIN_QUIET_MS);
+}
+
+static void board_send_chunk(struct board *b, int cmd)
+{
+	struct req_flash_rw req;
+	size_t len;
+
+	len = b->image->len - b->offset;
+	if (len > FLASH_CHUNK_SIZE)
+		len = FLASH_CHUNK_SIZE;
+
+	prep_flash_rw(&req, cmd, &b->image->buf[b->offset], b->offset, len);
+	patch_range(&b->dev, req.data, b->offset, len);
+	xor_range(&b->dev, req.data, b->offset, len);
+
+	board_send(b, &req, sizeof(struct req_hdr) + req.hdr.data_len,
+		   sizeof(struct resp_flash_rw));
+}
+
+/* Send the request for the current state */
+static void board_step(struct board *b)
+{
+	if (b->state == BOARD_WRITE || b->state == BOARD_VERIFY)
+		progress(&b->dev.progress, board_state_names[b->state],
+			 b->offset, b->image->len);
+	else
+		progress(&b->dev.progress, board_state_names[b->state], 0, 0);
+
+	switch (b->state) {
+	case BOARD_CHIP_TYPE: {
+		struct req_get_chip_type req = {
+			.hdr.command = CMD_CHIP_TYPE,
+			.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+			.string = "MCU ISP & WCH.CN",
+		};
+
+		board_send(b, &req, sizeof(req), sizeof(struct resp_chip_type));
+		break;
+	}
+
+	case BOARD_READ_CONFIG: {
+		struct req_read_config req = {
+			.hdr.command = CMD_READ_CONFIG,
+			.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+			.what = 0x1f,
+		};
+
+		board_send(b, &req, sizeof(req), sizeof(struct resp_read_config));
+		break;
+	}
+
+	case BOARD_SET_KEY:
+	case BOARD_VERIFY_KEY:
+		board_send(b, &set_key_req,
+			   sizeof(struct req_hdr) + set_key_req.hdr.data_len,
+			   sizeof(struct resp_set_key));
+		break;
+
+	case BOARD_WRITE_CONFIG: {
+		struct req_write_config req;
 
-	offset = 0;
+		prep_write_config(&b->dev, &req);
+		board_send(b, &req, sizeof(req), sizeof(struct resp_write_config));
+		break;
+	}
 
-	while (to_read) {
-		req.offset = offset;
+	case BOARD_ERASE: {
+		struct req_erase_flash req;
 
-		len = sizeof(resp.data);
-		if (len > to_read)
-			len = to_read;
+		prep_erase_code_flash(&req, b->image->len);
+		board_send(b, &req, sizeof(req), sizeof(struct resp_erase_flash));
+		break;
+	}
 
-		req.len = len;
+	case BOARD_WRITE:
+		board_send_chunk(b, CMD_WRITE_CODE_FLASH);
+		break;
 
-		ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
-		if (ret)
-			errx(EXIT_FAILURE, "Data read failure at offset %d", offset);
+	case BOARD_LAST_WRITE: {
+		struct req_flash_rw req;
 
-		if (resp.return_code != 0)
-			errx(EXIT_FAILURE, "Data read failure at offset %d", offset);
+		prep_flash_rw(&req, CMD_WRITE_CODE_FLASH, NULL, b->image->len, 0);
+		board_send(b, &req, sizeof(struct req_hdr) + req.hdr.data_len,
+			   sizeof(struct resp_flash_rw));
+		break;
+	}
+
+	case BOARD_VERIFY:
+		board_send_chunk(b, CMD_CMP_CODE_FLASH);
+		break;
+
+	case BOARD_REBOOT: {
+		struct req_reboot req = {
+			.hdr.command = CMD_REBOOT,
+			.hdr.data_len = sizeof(req) - sizeof(req.hdr),
+			.option = 0x01,
+		};
+
+		board_send(b, &req, sizeof(req), sizeof(struct resp_reboot));
+
+		/* 2.4.0 bootloaders do not respond */
+		if (b->state == BOARD_REBOOT && !b->dev.rules->wait_reboot_resp)
+			board_done(b);
+		break;
+	}
+
+	case BOARD_DONE:
+	case BOARD_FAILED:
+		break;
+	}
+}
+
+/* Verify after writing. The bootloader forgets the key when going
+ * from writing to comparing, so it is sent again. */
+static void board_start_verify(struct board *b)
+{
+	b->offset = 0;
+	b->state = BOARD_VERIFY_KEY;
+}
+
+/* A complete response frame has arrived. Check it and move on. */
+static void board_response(struct board *b, const struct route *routes,
+			   int n_routes)
+{
+	const uint8_t *resp = &b->rx[2];
+	size_t resp_len = b->resp_len - 3;
+	const char *reason;
+	uint16_t return_code;
+
+	if (b->rx[0] != SERIAL_RESP_MAGIC1 || b->rx[1] != SERIAL_RESP_MAGIC2) {
+		board_retry(b, "bad response magic");
+		return;
+	}
+
+	if (b->rx[b->resp_len - 1] != serial_crc(resp, resp_len)) {
+		board_retry(b, "bad response crc");
+		return;
+	}
+
+	/* A late response to an earlier command */
+	if (((const struct resp_hdr *)resp)->command != b->cmd) {
+		board_retry(b, "response to another command");
+		return;
+	}
+
+	record_rtt(&b->dev, b->cmd, b->req_len, resp_len,
+		   now_ms() - b->sent_ms);
+
+	if (b->dev.debug)
+		hexdump(b->port, resp, resp_len);
+
+	/* Most responses carry a return code after the header */
+	memcpy(&return_code, &resp[sizeof(struct resp_hdr)],
+	       sizeof(return_code));
+
+	switch (b->state) {
+	case BOARD_CHIP_TYPE: {
+		const struct resp_chip_type *r = (const void *)resp;
+
+		if (r->family == 0) {
+			board_fail(b, "chip is hosed, reset or power cycle it");
+			return;
+		}
+
+		b->dev.profile = find_profile(r->family, r->type);
+		if (b->dev.profile == NULL) {
+			board_fail(b, "device is not supported");
+			return;
+		}
+
+		if (routes) {
+			const struct route *route =
+				find_route(b->dev.profile, routes, n_routes);
+
+			if (route == NULL || route->fw.filename == NULL) {
+				board_fail(b, "no route for device");
+				return;
+			}
+
+			b->image = &route->fw;
+			b->write_config = !route->skip_config;
+		}
+
+		if (b->image && b->image->len > b->dev.profile->code_flash_size) {
+			board_fail(b, "firmware cannot fit in flash");
+			return;
+		}
+
+		b->state = BOARD_READ_CONFIG;
+		break;
+	}
+
+	case BOARD_READ_CONFIG:
+		parse_config(&b->dev, (const void *)resp);
+		b->dev.identify_ms = (now_ms() - b->start.tv_sec * 1000.0 -
+				      b->start.tv_nsec / 1000000.0);
+
+		if (!set_bootloader_quirks(&b->dev)) {
+			board_fail(b, "bootloader version is not supported");
+			return;
+		}
+
+		create_key(&b->dev);
+
+		if (b->image == NULL) {
+			board_done(b);
+			return;
+		}
+
+		if (b->flash && b->dev.n_patches) {
+			const char *error;
+
+			if (!patches_fit(b->dev.patches, b->dev.n_patches,
+					 b->image->len)) {
+				board_fail(b, "a patch is past the end of the firmware");
+				return;
+			}
+
+			/* Applied to each chunk as it is sent */
+			error = render_patches(&b->dev);
+			if (error) {
+				board_fail(b, error);
+				return;
+			}
+		}
+
+		b->state = b->flash ? BOARD_SET_KEY : BOARD_VERIFY_KEY;
+		break;
+
+	case BOARD_SET_KEY:
+	case BOARD_VERIFY_KEY: {
+		const struct resp_set_key *r = (const void *)resp;
+
+		if (r->key_checksum != key_checksum(&b->dev)) {
+			board_fail(b, "the device refused the key");
+			return;
+		}
+
+		b->offset = 0;
+		if (b->state == BOARD_VERIFY_KEY)
+			b->state = BOARD_VERIFY;
+		else if (b->write_config && config_needs_write(&b->dev))
+			b->state = BOARD_WRITE_CONFIG;
+		else
+			b->state = BOARD_ERASE;
+		break;
+	}
+
+	case BOARD_WRITE_CONFIG:
+		b->state = BOARD_ERASE;
+		break;
+
+	case BOARD_ERASE:
+		if (return_code) {
+			board_fail(b, "the device refused to erase the code flash");
+			return;
+		}
+
+		b->state = BOARD_WRITE;
+		break;
+
+	case BOARD_WRITE:
+	case BOARD_VERIFY:
+		if (return_code) {
+			board_fail(b, b->state == BOARD_WRITE ?
+				   "write code flash failure" :
+				   "check code flash failure");
+			return;
+		}
+
+		b->offset += FLASH_CHUNK_SIZE;
+		if (b->offset < b->image->len)
+			break;
+
+		b->offset = b->image->len;
+		progress(&b->dev.progress, board_state_names[b->state],
+			 b->offset, b->image->len);
+
+		if (b->state == BOARD_VERIFY)
+			b->state = b->flash ? BOARD_REBOOT : BOARD_DONE;
+		else if (b->dev.profile->need_last_write)
+			b->state = BOARD_LAST_WRITE;
+		else
+			board_start_verify(b);
+		break;
+
+	case BOARD_LAST_WRITE:
+		if (return_code) {
+			board_fail(b, "write code flash failure");
+			return;
+		}
+
+		board_start_verify(b);
+		break;
+
+	case BOARD_REBOOT:
+		if (return_code) {
+			board_fail(b, "the device refused to reboot");
+			return;
+		}
+
+		b->state = BOARD_DONE;
+		break;
+
+	case BOARD_DONE:
+	case BOARD_FAILED:
+		return;
+	}
+
+	if (b->state == BOARD_DONE) {
+		board_done(b);
+		return;
+	}
+
+	/* Between two commands, the bootloader is left waiting */
+	reason = session_stop_reason(&b->dev);
+	if (reason) {
+		b->stopped = true;
+		board_fail(b, reason);
+		return;
+	}
+
+	board_step(b);
+}
+
+static void board_read(struct board *b, const struct route *routes,
+		       int n_routes)
+{
+	ssize_t ret;
+
+	/* Its port is closed, from an earlier event of the batch */
+	if (b->state == BOARD_DONE || b->state == BOARD_FAILED)
+		return;
+
+	/* Late data is dropped until the port is quiet */
+	if (b->draining)
+		b->rx_len = 0;
+
+	ret = read(b->dev.fd, &b->rx[b->rx_len], sizeof(b->rx) - b->rx_len);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			board_fail(b, "read error");
+		return;
+	}
+
+	if (ret == 0) {
+		board_fail(b, "port hung up");
+		return;
+	}
+
+	if (b->draining) {
+		board_arm_timer(b, DRAIN_QUIET_MS);
+		return;
+	}
+
+	b->rx_len += ret;
+	if (b->rx_len > b->resp_len) {
+		board_retry(b, "unexpected data");
+		return;
+	}
+
+	if (b->rx_len < b->resp_len)
+		return;
+
+	/* Faults injected on the response, like faulty_transfer() */
+	if (b->dev.faults) {
+		struct link_faults *lf = b->dev.faults;
+
+		if (link_fault(lf, lf->drop)) {
+			lf->dropped++;
+			b->rx_len = 0;
+			return;
+		} else if (link_fault(lf, lf->truncate)) {
+			lf->truncated++;
+			b->rx_len--;
+			return;
+		} else if (link_fault(lf, lf->corrupt)) {
+			lf->corrupted++;
+			b->rx[b->resp_len - 1] ^= 0xff;
+		}
+	}
+
+	board_response(b, routes, n_routes);
+}
+
+/* The board timer expired: the link is quiet after a failed transfer,
+ * or the response didn't come in time */
+static void board_timer(struct board *b)
+{
+	const char *reason = session_stop_reason(&b->dev);
+
+	if (b->draining) {
+		b->draining = false;
+		if (reason) {
+			b->stopped = true;
+			board_fail(b, reason);
+			return;
+		}
+
+		board_transmit(b);
+		return;
+	}
+
+	if (reason) {
+		record_error(&b->dev, b->cmd);
+		b->stopped = true;
+		board_fail(b, reason);
+		return;
+	}
+
+	board_retry(b, "timeout");
+}
+
+/* Run a code flash / verify session, or just identify the chips, on
+ * every port. Returns the process exit code. */
+static int serial_engine(char **ports, int n_ports, struct device *tmpl,
+			 const struct route *routes, int n_routes,
+			 bool do_code_flash, bool do_stats, struct recorder *rec,
+			 const struct realtime *rt)
+{
+	struct epoll_event events[MAX_PORTS * 2];
+	struct epoll_event ev;
+	struct board *boards;
+	struct board *b;
+	int running = 0;
+	int failed = 0;
+	int epoll_fd;
+	int nfds;
+	int i;
+
+	boards = calloc(n_ports, sizeof(*boards));
+	if (boards == NULL)
+		errx(EXIT_FAILURE, "Can't allocate the boards");
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1)
+		err(EXIT_FAILURE, "Can't create the epoll instance");
+
+	/* All the boards share the one thread running the engine */
+	if (rt)
+		enter_realtime(tmpl, rt);
+
+	for (i = 0; i < n_ports; i++) {
+		b = &boards[i];
+		b->index = i;
+		b->epoll_fd = epoll_fd;
+		b->dev.debug = tmpl->debug;
+		b->dev.timeouts = tmpl->timeouts;
+		b->dev.patches = tmpl->patches;
+		b->dev.n_patches = tmpl->n_patches;
+		b->dev.progress = tmpl->progress;
+		b->dev.progress.name = ports[i];
+		b->port = ports[i];
+		b->image = tmpl->fw.buf ? &tmpl->fw : NULL;
+		b->flash = do_code_flash;
+		b->write_config = true;
+		b->state = BOARD_CHIP_TYPE;
+		b->dev.step = -1;
+		b->dev.start_us = wall_clock_us();
+		b->dev.session_start = now_ms();
+		b->dev.deadline_ms = tmpl->deadline_ms;
+		b->dev.retries = tmpl->retries;
+		if (tmpl->faults) {
+			b->dev.faults = malloc(sizeof(*b->dev.faults));
+			if (b->dev.faults == NULL)
+				errx(EXIT_FAILURE, "Can't allocate the link faults");
+
+			/* Different faults on each board, still reproducible */
+			*b->dev.faults = *tmpl->faults;
+			b->dev.faults->rng += (i + 1) * 0xbf58476d1ce4e5b9ull;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &b->start);
+
+		b->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (b->timer_fd == -1)
+			err(EXIT_FAILURE, "Can't create a timer");
+
+		b->dev.fd = open(b->port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (b->dev.fd == -1) {
+			board_fail(b, "can't open the port");
+			continue;
+		}
+
+		if (setup_serial_port(b->dev.fd) < 0) {
+			board_fail(b, "can't configure the port");
+			continue;
+		}
+
+		b->dev.low_latency = set_serial_low_latency(b->dev.fd, b->port);
+
+		/* Drop whatever a previous session left behind */
+		tcflush(b->dev.fd, TCIOFLUSH);
+
+		/* Even indexes are the ports, odd ones the timers */
+		ev.events = EPOLLIN;
+		ev.data.u32 = i * 2;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, b->dev.fd, &ev) == -1)
+			err(EXIT_FAILURE, "Can't watch the serial port");
+
+		ev.data.u32 = i * 2 + 1;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, b->timer_fd, &ev) == -1)
+			err(EXIT_FAILURE, "Can't watch the timer");
+
+		board_step(b);
+	}
+
+	sessions_running = true;
+
+	while (1) {
+		running = 0;
+		for (i = 0; i < n_ports; i++) {
+			if (boards[i].state != BOARD_DONE &&
+			    boards[i].state != BOARD_FAILED)
+				running++;
+		}
+
+		if (running == 0)
+			break;
+
+		nfds = epoll_wait(epoll_fd, events, MAX_PORTS * 2, -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "epoll_wait failed");
+		}
+
+		for (i = 0; i < nfds; i++) {
+			b = &boards[events[i].data.u32 / 2];
+
+			if (events[i].data.u32 & 1) {
+				uint64_t expirations;
+
+				if (read(b->timer_fd, &expirations,
+					 sizeof(expirations)) > 0 &&
+				    b->state != BOARD_DONE &&
+				    b->state != BOARD_FAILED)
+					board_timer(b);
+			} else {
+				if (events[i].events & EPOLLOUT &&
+				    b->state != BOARD_DONE &&
+				    b->state != BOARD_FAILED)
+					board_flush(b);
+				if (events[i].events & ~EPOLLOUT)
+					board_read(b, routes, n_routes);
+			}
+		}
+	}
+
+	sessions_running = false;
+
+	for (i = 0; i < n_ports; i++) {
+		b = &boards[i];
+
+		printf("%s: ", b->port);
+		if (b->dev.profile)
+			printf("%s ", b->dev.profile->name);
+
+		if (b->state == BOARD_FAILED && b->stopped) {
+			printf("%s in %s at offset 0x%zx", b->error,
+			       board_state_names[b->failed_state], b->offset);
+			failed++;
+		} else if (b->state == BOARD_FAILED) {
+			printf("failed in %s: %s", board_state_names[b->failed_state],
+			       b->error);
+			failed++;
+		} else if (b->image) {
+			printf("%s", b->flash ? "flashed" : "firmware is good");
+		} else {
+			printf("bootloader %d.%d.%d",
+			       (b->dev.bv >> 16) & 0xff, (b->dev.bv >> 8) & 0xff,
+			       b->dev.bv & 0xff);
+		}
+
+		printf(" (%.2f s)\n",
+		       (b->end.tv_sec - b->start.tv_sec) +
+		       (b->end.tv_nsec - b->start.tv_nsec) / 1e9);
+
+		if (do_stats)
+			print_stats(&b->dev);
+
+		if (rt)
+			print_latency(&b->dev);
+
+		if (b->dev.faults)
+			print_faults(&b->dev, b->state != BOARD_FAILED);
+
+		if (rec) {
+			if (b->image) {
+				b->dev.fw.filename = b->image->filename;
+				b->dev.fw.buf = b->image->buf;
+				b->dev.fw.len = b->image->len;
+				b->dev.fw.crc = b->image->crc;
+				b->dev.fw.crc_valid = b->image->crc_valid;
+			}
+			record_session(rec, &b->dev, b->state == BOARD_FAILED);
+		}
+
+		if (b->dev.fd > 0)
+			close(b->dev.fd);
+		close(b->timer_fd);
+		free(b->dev.faults);
+	}
+
+	close(epoll_fd);
+	free(boards);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+/* Time a harmless request, and summarize the round trips */
+static void bench_test(struct device *dev, struct bench_result *res,
+		       const char *name, void *req, int req_len,
+		       void *resp, int resp_len, int payload)
+{
+	float samples[BENCH_SAMPLES];
+	double start = now_ms();
+	double total = 0;
+	double t;
+	unsigned int i;
+
+	memset(res, 0, sizeof(*res));
+	snprintf(res->name, sizeof(res->name), "%s", name);
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		if (i && now_ms() - start > BENCH_TEST_MS)
+			break;
+
+		t = now_ms();
+		if (transfer(dev, req, req_len, resp, resp_len))
+			errx(EXIT_FAILURE, "Link benchmark failed on %s", name);
+
+		samples[i] = now_ms() - t;
+		total += samples[i];
+
+		if (i)
+			res->jitter_ms += samples[i] > samples[i - 1] ?
+				samples[i] - samples[i - 1] :
+				samples[i - 1] - samples[i];
+	}
+
+	res->count = i;
+	if (i > 1)
+		res->jitter_ms /= i - 1;
+	if (payload && total > 0)
+		res->kib_s = payload * i / 1024.0 / (total / 1000);
+
+	qsort(samples, i, sizeof(samples[0]), cmp_float);
+	res->min_ms = samples[0];
+	res->p50_ms = samples[(unsigned int)(0.50 * (i - 1) + 0.5)];
+	res->p99_ms = samples[(unsigned int)(0.99 * (i - 1) + 0.5)];
+	res->max_ms = samples[i - 1];
+}
+
+static int run_bench_tests(struct device *dev, struct bench_result *results)
+{
+	static const int read_sizes[] = { 8, 32, 58 };
+	struct req_get_chip_type chip_req = {
+		.hdr.command = CMD_CHIP_TYPE,
+		.hdr.data_len = sizeof(chip_req) - sizeof(chip_req.hdr),
+		.string = "MCU ISP & WCH.CN",
+	};
+	struct req_read_config config_req = {
+		.hdr.command = CMD_READ_CONFIG,
+		.hdr.data_len = sizeof(config_req) - sizeof(config_req.hdr),
+		.what = 0x1f,
+	};
+	struct req_read_data_flash read_req = {
+		.hdr.command = CMD_READ_DATA_FLASH,
+	};
+	struct resp_chip_type chip_resp;
+	struct resp_read_config config_resp;
+	struct resp_read_data_flash read_resp;
+	char name[16];
+	int n = 0;
+	int i;
+
+	bench_test(dev, &results[n++], "chip-type", &chip_req,
+		   sizeof(chip_req), &chip_resp, sizeof(chip_resp), 0);
+	bench_test(dev, &results[n++], "read-config", &config_req,
+		   sizeof(config_req), &config_resp, sizeof(config_resp), 0);
+
+	/* Reading the data flash changes nothing, and gives a payload */
+	for (i = 0; i < 3; i++) {
+		if (read_sizes[i] > dev->profile->data_flash_size)
+			break;
+
+		read_req.len = read_sizes[i];
+		snprintf(name, sizeof(name), "read-data-%d", read_sizes[i]);
+		bench_test(dev, &results[n++], name, &read_req,
+			   sizeof(read_req), &read_resp, sizeof(read_resp),
+			   read_sizes[i]);
+	}
+
+	return n;
+}
+
+/* Load a baseline. Returns the number of results, or -1 if there is
+ * no baseline yet. */
+static int load_bench_baseline(const char *filename,
+			       struct bench_result *results)
+{
+	struct bench_result *res;
+	char line[256];
+	int n = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL && errno == ENOENT)
+		return -1;
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't open the link baseline");
+
+	while (n < BENCH_MAX_TESTS && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+
+		res = &results[n];
+		memset(res, 0, sizeof(*res));
+		if (sscanf(line, "%15s %lf %lf %lf %lf", res->name,
+			   &res->p50_ms, &res->p99_ms, &res->jitter_ms,
+			   &res->kib_s) == 5)
+			n++;
+	}
+
+	fclose(f);
+
+	return n;
+}
+
+static void save_bench_baseline(const char *filename,
+				const struct bench_result *results, int n)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(filename, "w");
+	if (f == NULL)
+		err(EXIT_FAILURE, "Can't create the link baseline");
+
+	fprintf(f, "# test p50_ms p99_ms jitter_ms kib_s\n");
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s %.3f %.3f %.3f %.1f\n", results[i].name,
+			results[i].p50_ms, results[i].p99_ms,
+			results[i].jitter_ms, results[i].kib_s);
+
+	if (fclose(f))
+		err(EXIT_FAILURE, "Can't write the link baseline");
+}
+
+/* Benchmark the link, and compare it with a baseline if there is one,
+ * or save it as the baseline. Returns the process exit code. */
+static int link_bench(struct device *dev, const char *baseline_file)
+{
+	struct bench_result results[BENCH_MAX_TESTS];
+	struct bench_result baseline[BENCH_MAX_TESTS];
+	const struct bench_result *base;
+	const struct bench_result *res;
+	int n_baseline = -1;
+	int regressions = 0;
+	int n;
+	int i;
+	int j;
+
+	n = run_bench_tests(dev, results);
+
+	if (baseline_file)
+		n_baseline = load_bench_baseline(baseline_file, baseline);
+
+	printf("Link benchmark:\n");
+	printf("  %-13s %6s %8s %8s %8s %8s %9s %8s%s\n", "test", "count",
+	       "min ms", "p50 ms", "p99 ms", "max ms", "jitter ms", "KiB/s",
+	       n_baseline >= 0 ? "  baseline" : "");
+
+	for (i = 0; i < n; i++) {
+		res = &results[i];
+
+		printf("  %-13s %6u %8.3f %8.3f %8.3f %8.3f %9.3f %8.1f",
+		       res->name, res->count, res->min_ms, res->p50_ms,
+		       res->p99_ms, res->max_ms, res->jitter_ms, res->kib_s);
+
+		base = NULL;
+		for (j = 0; j < n_baseline; j++) {
+			if (strcmp(baseline[j].name, res->name) == 0)
+				base = &baseline[j];
+		}
+
+		if (n_baseline < 0) {
+			printf("\n");
+			continue;
+		}
+
+		if (base == NULL) {
+			printf("  none\n");
+			continue;
+		}
 
-		memcpy(&dev->data_dump.buf[offset], resp.data, len);
+		/* A tiny absolute difference is not a regression */
+		if (res->p50_ms > base->p50_ms * BENCH_REGRESSION &&
+		    res->p50_ms - base->p50_ms > 0.05) {
+			printf("  p50 %+.0f%%, SLOWER\n",
+			       (res->p50_ms / base->p50_ms - 1) * 100);
+			regressions++;
+		} else if (base->kib_s && res->kib_s * BENCH_REGRESSION < base->kib_s) {
+			printf("  %+.0f%% KiB/s, SLOWER\n",
+			       (res->kib_s / base->kib_s - 1) * 100);
+			regressions++;
+		} else {
+			printf("  p50 %+.0f%%, ok\n", base->p50_ms > 0 ?
+			       (res->p50_ms / base->p50_ms - 1) * 100 : 0);
+		}
+	}
 
-		to_read -= len;
-		offset += len;
+	if (baseline_file && n_baseline < 0) {
+		save_bench_baseline(baseline_file, results, n);
+		printf("Saved as the baseline in %s\n", baseline_file);
 	}
-}
 
-static void verify_data_flash(struct device *dev)
-{
-	if (dev->data.encrypted) {
-		/* The data was just written previously to the flash,
-		 * and encrypted. It needs to been decrypted now so
-		 * the comparison can happen. */
-		encrypt_or_decrypt(dev, &dev->data);
+	if (regressions) {
+		printf("%d test%s slower than the baseline\n", regressions,
+		       regressions > 1 ? "s are" : " is");
+		return EXIT_FAILURE;
 	}
 
-	if (memcmp(dev->data.buf, dev->data_dump.buf, dev->data.len) != 0)
-		errx(EXIT_FAILURE, "Data flash doesn't match");
+	return EXIT_SUCCESS;
 }
 
-static void dump_data_flash(struct device *dev)
-{
-	int fd;
-	int ret;
-
-	fd = creat(dev->data_dump.filename, 0600);
-	if (fd == -1)
-		err(EXIT_FAILURE, "Can't create the file to dump the data flash");
+/* Device whose statistics are printed on exit */
+static struct device *stats_dev;
 
-	ret = write(fd, dev->data_dump.buf, dev->data.max_flash_size);
-	if (ret == -1)
-		err(EXIT_FAILURE, "Can't dump the data flash");
-
-	if (ret != dev->profile->data_flash_size)
-		err(EXIT_FAILURE, "Can't dump all the data flash to file");
-
-	close(fd);
+static void print_stats_at_exit(void)
+{
+	if (stats_dev)
+		print_stats(stats_dev);
 }
 
-/* Reboot the device */
-static void reboot_device(struct device *dev)
+/* Device whose faulty link is reported on exit */
+static struct device *faults_dev;
+static bool faults_ok;
+
+static void faults_at_exit(void)
 {
-	struct req_reboot req = {
-		.hdr.command = CMD_REBOOT,
-		.hdr.data_len = sizeof(req) - sizeof(req.hdr),
-		.option = 0x01,
-	};
-	struct resp_reboot resp;
-	int ret;
+	if (faults_dev)
+		print_faults(faults_dev, faults_ok);
+}
 
-	ret = transfer(dev, &req, sizeof(req), &resp, sizeof(resp));
+#ifndef WIN32
+/* Device whose session is recorded on exit, if it didn't finish */
+static struct device *recorded_dev;
+static struct recorder recorder;
 
-	/* 2.4.0 bootloaders do not respond. 2.8.0 does. */
-	if (!dev->wait_reboot_resp)
-		return;
+static void record_at_exit(void)
+{
+	if (recorded_dev)
+		record_session(&recorder, recorded_dev, 1);
+}
 
-	if (ret)
-		errx(EXIT_FAILURE, "Can't reboot the device");
+/* Device whose failure is reported on exit, if it didn't finish */
+static struct device *progress_dev;
 
-	if (resp.return_code != 0x00)
-		errx(EXIT_FAILURE, "The device refused to reboot");
+static void progress_at_exit(void)
+{
+	if (progress_dev)
+		progress(&progress_dev->progress, "failed", 0, 0);
 }
+#endif
 
-int main(int argc, char *argv[])
+/* Parse the command line into the device settings and the options */
+static void parse_options(int argc, char *argv[], struct device *dev,
+			  struct options *o)
 {
-	struct device dev = {};
-	bool do_code_flash = false;
-	bool do_code_verify = false;
-	bool do_data_flash = false;
-	bool do_data_verify = false;
-	bool do_data_dump = false;
+	char *end;
 	int c;
-	int i;
-#ifndef WIN32
-	char *port = NULL;
+
+	o->config = true;
+	o->discover_patterns = DISCOVER_PATTERNS;
+#ifdef __linux__
+	o->rt.policy = SCHED_FIFO;
+	o->rt.priority = 50;
 #endif
 
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "c:df:hk:l:m:"
+		c = getopt_long(argc, argv, "a:B:c:de:E:f:hi::J:k:l:m:L::M:nN:P:q:r:R:sSt:T:w::X:y:"
 #ifndef WIN32
-				"p:"
+				"b:D::g:H:p:x:"
+#endif
+#ifdef __linux__
+				"F::GW"
 #endif
 				, long_options, &option_index);
 		if (c == -1)
@@ -729,149 +7090,678 @@ int main(int argc, char *argv[])
 			printf("\n");
 			break;
 		case 'c':
-			dev.fw.filename = optarg;
-			do_code_verify = true;
+			dev->fw.filename = optarg;
+			o->code_verify = true;
 			break;
 		case 'd':
-			dev.debug = true;
+			dev->debug = true;
+			break;
+		case 'e':
+			dev->erase_size = strtoul(optarg, &end, 0);
+			if (*end || dev->erase_size == 0)
+				errx(EXIT_FAILURE, "Invalid erase size '%s'", optarg);
+			break;
+		case 'E':
+			o->emulate = optarg;
+			break;
+		case 'y':
+			o->emulate = optarg;
+			dry_run = true;
+			break;
+		case 'M':
+			o->model_file = optarg;
+			break;
+		case 'B':
+			o->budget_file = optarg;
+			break;
+		case 'X':
+			parse_faults(&o->faults, optarg);
+			dev->faults = &o->faults;
+			break;
+		case 'a':
+			dev->deadline_ms = strtoul(optarg, NULL, 0);
+			if (dev->deadline_ms == 0)
+				errx(EXIT_FAILURE, "Invalid session deadline");
+			break;
+		case 'N':
+			dev->retries = atoi(optarg);
+			if (dev->retries < 0)
+				errx(EXIT_FAILURE, "Invalid number of retries");
 			break;
 		case 'f':
-			dev.fw.filename = optarg;
-			do_code_flash = true;
-			do_code_verify = true; /* always verify after flashing */
+			dev->fw.filename = optarg;
+			o->code_flash = true;
+			o->code_verify = true; /* always verify after flashing */
+			break;
+		case 'i':
+			o->interleave = optarg ? atoi(optarg) : 16;
+			if (o->interleave < 1)
+				errx(EXIT_FAILURE, "Invalid number of chunks to interleave");
 			break;
 		case 'k':
-			dev.data.filename = optarg;
-			do_data_flash = true;
-			do_data_verify = true;
+			dev->data.filename = optarg;
+			o->data_flash = true;
+			o->data_verify = true;
 			break;
 		case 'l':
-			dev.data.filename = optarg;
-			do_data_verify = true;
+			dev->data.filename = optarg;
+			o->data_verify = true;
 			break;
 		case 'm':
-			dev.data_dump.filename = optarg;
-			do_data_dump = true;
+			dev->data_dump.filename = optarg;
+			o->data_dump = true;
+			break;
+		case 'L':
+			o->link_bench = true;
+			o->bench_file = optarg;
+			break;
+		case 'n':
+			o->full_plan = true;
+			break;
+		case 'P':
+			if (dev->n_patches == MAX_PATCHES)
+				errx(EXIT_FAILURE, "Too many patches");
+			parse_patch(&o->patches[dev->n_patches++], optarg);
+			dev->patches = o->patches;
+			break;
+		case 'q':
+			o->query = optarg;
+			break;
+		case 'r':
+			o->route_file = optarg;
+			break;
+		case 'J':
+			o->job_file = optarg;
+			break;
+		case 'R':
+			o->record_file = optarg;
+			break;
+		case 's':
+			o->stats = true;
+			break;
+		case 'S':
+			o->scan = true;
+			break;
+		case 't':
+			parse_timeouts(&dev->timeouts, optarg);
+			break;
+		case 'w':
+			parse_app_wait(&o->app_wait, optarg);
+			o->wait_app = true;
+			break;
+		case 'T':
+			o->tpl_file = optarg;
+			o->data_flash = true;
+			o->data_verify = true;
 			break;
 #ifndef WIN32
+		case 'b':
+			parse_line_seq(&o->enter_seq, optarg);
+			dev->enter_seq = &o->enter_seq;
+			break;
+		case 'x':
+			parse_line_seq(&o->reset_seq, optarg);
+			dev->reset_seq = &o->reset_seq;
+			break;
+		case 'D':
+			o->discover = true;
+			if (optarg)
+				o->discover_patterns = optarg;
+			break;
+		case 'g':
+			dev->progress.fd = open_progress(optarg);
+			break;
+		case 'H':
+			o->harvest_file = optarg;
+			o->data_dump = true;
+			break;
 		case 'p':
-			port = optarg;
+			if (o->n_ports == MAX_PORTS)
+				errx(EXIT_FAILURE, "Too many serial ports");
+			o->ports[o->n_ports++] = optarg;
+			break;
+#endif
+#ifdef __linux__
+		case 'F':
+			if (optarg)
+				parse_realtime(&o->rt, optarg);
+			o->realtime = true;
+			break;
+		case 'G':
+			o->gang = true;
+			break;
+		case 'W':
+			o->watch = true;
 			break;
 #endif
 		case 'h':
 			usage();
-			return EXIT_SUCCESS;
+			exit(EXIT_SUCCESS);
 		default:
-		       return EXIT_FAILURE;
+			exit(EXIT_FAILURE);
 		}
 	}
 
 	if (optind < argc)
 		errx(EXIT_FAILURE, "Extra argument: %s", argv[optind]);
 
+	if (dev->fw.filename && dev->data.filename &&
+	    strcmp(dev->fw.filename, "-") == 0 &&
+	    strcmp(dev->data.filename, "-") == 0)
+		errx(EXIT_FAILURE, "Only one file can be read from stdin");
+
+	if (dry_run && (o->record_file || o->harvest_file || o->wait_app ||
+			dev->data_dump.filename))
+		errx(EXIT_FAILURE, "A dry run can't record, harvest, dump or wait");
+
+	if (o->model_file && !dry_run)
+		errx(EXIT_FAILURE, "A latency model is only used by a dry run");
+}
+
+#ifndef WIN32
+/* Look up the flight recorder or the data flash archive. Returns the
+ * process exit code. */
+static int run_query(struct options *o)
+{
+	if (o->harvest_file) {
+		open_archive(&o->archive, o->harvest_file);
+		query_archive(&o->archive, o->query);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (o->record_file == NULL)
+		errx(EXIT_FAILURE, "A query needs a flight recorder or an archive file");
+
+	open_recorder(&recorder, o->record_file);
+	query_recorder(&recorder, o->query);
+
+	return EXIT_SUCCESS;
+}
+
+/* Add the serial ports with a bootloader to the ones given. Returns
+ * false if there is nothing else to do. */
+static bool discover_ports(const struct device *dev, struct options *o)
+{
+	/* Probes that don't answer quickly have no bootloader */
+	o->n_ports += discover_serial_ports(o->discover_patterns,
+					    dev->timeouts.initial_ms ==
+					    default_timeouts.initial_ms ?
+					    300 : dev->timeouts.initial_ms,
+					    &o->ports[o->n_ports],
+					    MAX_PORTS - o->n_ports);
+
+	if (!o->code_flash && !o->code_verify && !o->data_flash &&
+	    !o->data_verify && !o->data_dump && !o->route_file &&
+	    !o->job_file && !o->scan)
+		return false;
+
+	if (o->n_ports == 0)
+		errx(EXIT_FAILURE, "No bootloader found on the serial ports");
+
+	return true;
+}
+
+/* Inventory of the devices. Returns the process exit code. */
+static int run_scan(struct device *dev, struct options *o)
+{
+	/* A missing device should not hold the inventory back */
+	if (dev->timeouts.initial_ms == default_timeouts.initial_ms)
+		dev->timeouts.initial_ms = 300;
+
+	return scan_devices(dev, o->ports, o->n_ports);
+}
+#endif
+
+/* Load what gives the images and operations, other than the image
+ * files, and check they go together */
+static void load_inputs(struct device *dev, struct options *o)
+{
+	if (o->model_file)
+		load_latency_model(o->model_file, o->model);
+
+	if (dev->n_patches && !o->code_flash && !o->route_file)
+		errx(EXIT_FAILURE, "Patches need a firmware to flash");
+
+	if (o->tpl_file) {
+		if (dev->data.filename)
+			errx(EXIT_FAILURE, "Data template and data file are exclusive");
+
+		load_template(&o->data_tpl, o->tpl_file);
+	}
+
+	if (o->route_file) {
+		if (dev->fw.filename || dev->data.filename)
+			errx(EXIT_FAILURE, "Routing table and files are exclusive");
+
+		o->n_routes = load_routes(dev, o->route_file, &o->routes);
+	}
+
+	if (o->job_file) {
+		if (dev->fw.filename || dev->data.filename || o->data_dump ||
+		    o->route_file || o->tpl_file || dev->n_patches)
+			errx(EXIT_FAILURE, "A job gives all the images and operations");
+
+		load_job(dev, &o->job, o->job_file);
+	}
+
+	/* The serial engine injects them on the responses of real boards */
+	if (dev->faults && !o->emulate && o->n_ports < 2)
+		errx(EXIT_FAILURE, "Link faults need an emulated chip, or several serial ports");
+
+#ifndef WIN32
+	if ((dev->enter_seq || dev->reset_seq) &&
+	    (o->n_ports != 1 || o->emulate))
+		errx(EXIT_FAILURE, "Line sequences need a single serial port");
+#endif
+}
+
+#ifdef __linux__
+/* Flash all the serial ports at once. Returns the process exit
+ * code. */
+static int run_serial_engine(struct device *dev, struct options *o)
+{
+	int i;
+
+	if (o->data_flash || o->data_verify || o->data_dump || o->job_file)
+		errx(EXIT_FAILURE, "Only the code flash can be used with several ports");
+
+	/* The boards get the whole image, never a stream */
+	if (dev->erase_size)
+		errx(EXIT_FAILURE, "The erase size only applies to a firmware flashed from a pipe");
+
+	/* The time on real links isn't simulated */
+	if (dev->faults && (o->faults.jitter_ms || o->faults.stall))
+		errx(EXIT_FAILURE, "Only drop, truncate and corrupt faults apply to serial ports");
+
+	if (dev->fw.filename) {
+		max_flash_sizes(&dev->fw.max_flash_size, &dev->data.max_flash_size);
+		open_content(&dev->fw);
+		load_file(dev, &dev->fw);
+	}
+
+	/* The images are shared by all the boards */
+	if (o->record_file) {
+		cache_content_crc(dev, &dev->fw);
+		for (i = 0; i < o->n_routes; i++)
+			cache_content_crc(dev, &o->routes[i].fw);
+	}
+
+	return serial_engine(o->ports, o->n_ports, dev, o->routes, o->n_routes,
+			     o->code_flash || o->routes, o->stats,
+			     o->record_file ? &recorder : NULL,
+			     o->realtime ? &o->rt : NULL);
+}
+
+/* Watch mode only goes with a single firmware file to flash */
+static void check_watch(const struct device *dev, const struct options *o)
+{
+	if (!o->code_flash || strcmp(dev->fw.filename, "-") == 0 ||
+	    o->data_flash || o->data_verify || o->data_dump || o->route_file ||
+	    dev->n_patches || o->gang || o->wait_app || o->record_file ||
+	    dry_run)
+		errx(EXIT_FAILURE, "Watch mode only flashes a firmware file");
+}
+
+/* Start a session per USB device in ISP mode. Returns, in the process
+ * of each session, the location of its device. */
+static const struct location *join_gang(struct device *dev,
+					const struct options *o)
+{
+	if (o->n_ports || o->emulate)
+		errx(EXIT_FAILURE, "A gang is only made of USB devices");
+
+	if (dev->data_dump.filename ||
+	    (dev->fw.filename && strcmp(dev->fw.filename, "-") == 0) ||
+	    (dev->data.filename && strcmp(dev->data.filename, "-") == 0))
+		errx(EXIT_FAILURE, "A gang can't share stdin or a dump file");
+
+	return start_gang(dev);
+}
+#endif
+
+/* Report the statistics, the faults, the record and the progress of
+ * the session even if it fails */
+static void report_at_exit(struct device *dev, struct options *o,
+			   const struct location *loc)
+{
+#ifndef WIN32
+	/* After the gang started, as each session locks the file */
+	if (o->harvest_file) {
+		open_archive(&o->archive, o->harvest_file);
+		dev->archive = &o->archive;
+	}
+#endif
+
+	if (o->stats) {
+		stats_dev = dev;
+		atexit(print_stats_at_exit);
+	}
+
+	if (dev->faults) {
+		faults_dev = dev;
+		atexit(faults_at_exit);
+	}
+
+#ifndef WIN32
+	if (o->record_file) {
+		recorded_dev = dev;
+		atexit(record_at_exit);
+	}
+
+	if (dev->progress.fd != -1) {
+		dev->progress.name = loc ? loc->name :
+			o->n_ports ? o->ports[0] : "usb";
+		progress_dev = dev;
+		atexit(progress_at_exit);
+	}
+#endif
+}
+
+/* Open the device of a single session, and get its chip type */
+static void open_session(struct device *dev, const struct options *o,
+			 const struct location *loc)
+{
+	dev->start_us = wall_clock_us();
+	dev->session_start = now_ms();
+	sessions_running = true;
+
+	if (o->emulate) {
+		open_emulator(dev, o->emulate);
+
+		/* USB checks its packets, only a serial frame is damaged */
+		if (dev->faults && !dev->emu->serial &&
+		    (o->faults.truncate || o->faults.corrupt))
+			errx(EXIT_FAILURE, "Truncate and corrupt faults need an emulated serial link");
+	}
+#ifndef WIN32
+	else if (o->n_ports)
+		open_serial_device(dev, o->ports[0]);
+#endif
+#ifdef __linux__
+	else if (loc)
+		open_usb_device_at(dev, loc);
+#endif
+	else
+		open_usb_device(dev);
+
 #ifndef WIN32
-	if (port)
-		open_serial_device(&dev, port);
+	if (dev->enter_seq)
+		enter_bootloader(dev);
 	else
 #endif
-		open_usb_device(&dev);
+		read_chip_type(dev);
+	printf("Found device %s\n", dev->profile->name);
+
+#ifdef __linux__
+	if (dev->gang)
+		gang_set_job(dev);
+#endif
+}
+
+/* Take the images and operations of the route matching the chip */
+static void apply_route(struct device *dev, struct options *o)
+{
+	const struct route *route = select_route(dev, o->routes, o->n_routes);
+
+	if (route->fw.filename) {
+		if (route->fw.len > dev->fw.max_flash_size)
+			errx(EXIT_FAILURE, "Firmware cannot fit in flash");
+
+		dev->fw.filename = route->fw.filename;
+		dev->fw.len = route->fw.len;
+		dev->fw.buf = route->fw.buf;
+		o->code_flash = true;
+		o->code_verify = true;
+	}
+
+	if (route->data.filename && o->tpl_file)
+		errx(EXIT_FAILURE, "Route %s has data, and a data template is given",
+		     route->pattern);
+
+	if (route->data.filename) {
+		if (route->data.len > dev->data.max_flash_size)
+			errx(EXIT_FAILURE, "Data cannot fit in data flash");
+
+		dev->data.filename = route->data.filename;
+		dev->data.len = route->data.len;
+		dev->data.buf = route->data.buf;
+		o->data_flash = true;
+		o->data_verify = true;
+	}
+
+	o->config = !route->skip_config;
+
+	printf("Using route %s\n", route->pattern);
+}
 
-	read_chip_type(&dev);
-	printf("Found device %s\n", dev.profile->name);
+/* Read the configuration, and check the bootloader is supported */
+static void identify_device(struct device *dev)
+{
+	int i;
 
-	read_config(&dev);
+	read_config(dev);
+
+#ifndef WIN32
+	/* The median of the config reads, without the retried ones */
+	if (dev->fd)
+		printf("Serial round trip %.2f ms%s\n",
+		       rtt_percentile(&dev->stats[CMD_READ_CONFIG - CMD_CHIP_TYPE], 50),
+		       dev->low_latency ? ", low latency" : "");
+#endif
 
 	printf("Bootloader version %d.%d.%d\n",
-	       (dev.bv >> 16) & 0xff, (dev.bv >> 8) & 0xff, dev.bv & 0xff);
+	       (dev->bv >> 16) & 0xff, (dev->bv >> 8) & 0xff, dev->bv & 0xff);
 
 	printf("Unique chip ID ");
-	for (i = 0; i < dev.profile->mcu_id_len; i++) {
+	for (i = 0; i < dev->profile->mcu_id_len; i++) {
 		if (i > 0)
 			printf("-");
-		printf("%02x", dev.id[i]);
+		printf("%02x", dev->id[i]);
 	}
 	printf("\n");
 
 	/* check bootloader version */
-	switch (dev.bv) {
-	case 0x020301:
-	case 0x020400:
-		dev.wait_reboot_resp = false;
-		break;
+	if (!set_bootloader_quirks(dev))
+		errx(EXIT_FAILURE, "This bootloader version is not supported");
 
-	case 0x020500:
-	case 0x020600:
-	case 0x020700:
-	case 0x020800:
-	case 0x020900:
-		dev.wait_reboot_resp = true;
-		break;
+	dev->identify_ms = now_ms() - dev->session_start;
+}
 
-	default:
-		errx(EXIT_FAILURE, "This bootloader version is not supported");
-	}
+/* Load, patch and encrypt the images for the chip */
+static void prepare_images(struct device *dev, struct options *o)
+{
+	const char *error;
+
+	create_key(dev);
 
-	create_key(&dev);
+	if (o->job_file)
+		prepare_job(dev, &o->job);
 
-	if (do_code_flash || do_code_verify) {
-		load_file(&dev, &dev.fw);
-		encrypt_or_decrypt(&dev, &dev.fw);
+	if ((o->code_flash || o->code_verify) && !dev->fw.buf) {
+		open_content(&dev->fw);
+
+		/* A streamed firmware is read while it is flashed */
+		if (!o->code_flash || !dev->fw.stream)
+			load_file(dev, &dev->fw);
 	}
 
-	if (do_data_flash || do_data_verify)
-		load_file(&dev, &dev.data);
+	if (dev->erase_size) {
+		if (!o->code_flash || !dev->fw.stream)
+			errx(EXIT_FAILURE, "The erase size only applies to a firmware flashed from a pipe");
+		if (dev->erase_size > dev->fw.max_flash_size)
+			errx(EXIT_FAILURE, "Erase size is larger than the code flash");
+	}
 
-	/* Code flash */
+	if (dev->n_patches && o->code_flash) {
+		if (dev->fw.buf && !patches_fit(dev->patches, dev->n_patches,
+						dev->fw.len))
+			errx(EXIT_FAILURE, "A patch is past the end of the firmware");
 
-	if (do_code_flash) {
-		send_key(&dev);
-		write_config(&dev);
+		error = render_patches(dev);
+		if (error)
+			errx(EXIT_FAILURE, "Can't patch the firmware: %s", error);
 
-		erase_code_flash(&dev);
-		write_code_flash(&dev);
+		print_patches(dev);
 
-		printf("Code flashing successful\n");
+		/* Patched in the clear image, before its only encryption */
+		if (dev->fw.buf)
+			patch_range(dev, dev->fw.buf, 0, dev->fw.len);
 	}
 
-	if (do_code_verify) {
-		send_key(&dev);
-		verify_code_flash(&dev);
+	if (dev->fw.buf)
+		encrypt_or_decrypt(dev, &dev->fw);
 
-		printf("Firmware is good\n");
+	if (o->tpl_file)
+		render_template(dev, &o->data_tpl);
+
+	if ((o->data_flash || o->data_verify) && !dev->data.buf) {
+		open_content(&dev->data);
+		load_file(dev, &dev->data);
 	}
+}
 
-	/* Data flash */
+/* Run the session on the identified device, then keep watching the
+ * firmware or wait for the application if asked to. Returns the
+ * process exit code. */
+static int run_session(struct device *dev, struct options *o)
+{
+	struct session_ops ops = {
+		.code_flash = o->code_flash,
+		.code_verify = o->code_verify,
+		.data_flash = o->data_flash,
+		.data_verify = o->data_verify,
+		.data_dump = o->data_dump,
+		.write_config = o->config,
+		.full = o->full_plan,
+		.interleave = o->interleave,
+	};
+	struct plan plan;
 
-	if (do_data_flash) {
-		send_key(&dev);
-		encrypt_or_decrypt(&dev, &dev.data);
-		erase_data_flash(&dev);
-		write_data_flash(&dev);
+	plan_session(dev, &ops, &plan);
 
-		printf("Data flashing successful\n");
+#ifdef __linux__
+	if (o->watch && dev->fw.stream)
+		errx(EXIT_FAILURE, "Watch mode can't watch a pipe");
+#endif
+
+	if (o->wait_app) {
+		if (!o->code_flash || o->emulate)
+			errx(EXIT_FAILURE, "Only a flashed device reboots into its application");
+
+		arm_app_wait(dev, &o->app_wait);
 	}
 
-	if (do_data_verify || do_data_dump)
-		read_data_flash(&dev);
+#ifdef __linux__
+	if (o->realtime)
+		enter_realtime(dev, &o->rt);
+#endif
+
+	if (o->job_file)
+		run_job(dev, &o->job, o->full_plan);
+	else
+		run_plan(dev, &plan);
 
-	if (do_data_verify) {
-		verify_data_flash(&dev);
+	sessions_running = false;
 
-		printf("Data flash is good\n");
-	}
+#ifdef __linux__
+	if (o->realtime)
+		print_latency(dev);
+#endif
 
-	if (do_data_dump) {
-		dump_data_flash(&dev);
+	if (dry_run)
+		print_estimate(dev, o->model_file ? o->model : NULL);
 
-		printf("Dumped data flash to file\n");
+	if (o->budget_file && check_budget(dev, o->budget_file))
+		errx(EXIT_FAILURE, "The session doesn't fit its command budget");
+
+#ifdef __linux__
+	if (o->watch)
+		watch_firmware(dev, &ops, o->n_ports ? o->ports[0] : NULL);
+#endif
+
+	if (o->wait_app) {
+		o->app_wait.reboot_ms = dev->reboot_ms;
+		wait_for_app(&o->app_wait);
+	}
+
+#ifndef WIN32
+	if (recorded_dev) {
+		record_session(&recorder, dev, 0);
+		recorded_dev = NULL;
 	}
 
-	if (do_code_flash)
-		reboot_device(&dev);
+	progress(&dev->progress, "done", 0, 0);
+	progress_dev = NULL;
+#endif
+
+	faults_ok = true;
 
 	return 0;
 }
 
+int main(int argc, char *argv[])
+{
+	/* Static, so the exit handlers can still use them */
+	static struct device dev;
+	static struct options opts;
+	const struct location *loc = NULL;
+
+	dev.timeouts = default_timeouts;
+	dev.step = -1;
+	dev.progress.fd = -1;
+
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+
+	parse_options(argc, argv, &dev, &opts);
+
+#ifndef WIN32
+	if (opts.query)
+		return run_query(&opts);
+
+	if (opts.record_file)
+		open_recorder(&recorder, opts.record_file);
+
+	if (opts.discover && !discover_ports(&dev, &opts))
+		return EXIT_SUCCESS;
+
+	if (opts.scan)
+		return run_scan(&dev, &opts);
+#endif
+
+	load_inputs(&dev, &opts);
+
+#ifdef __linux__
+	if (opts.n_ports > 1)
+		return run_serial_engine(&dev, &opts);
+
+	if (opts.watch)
+		check_watch(&dev, &opts);
+
+	if (opts.gang)
+		loc = join_gang(&dev, &opts);
+#elif !defined(WIN32)
+	if (opts.n_ports > 1)
+		errx(EXIT_FAILURE, "Only one serial port is supported");
+#endif
+
+	report_at_exit(&dev, &opts, loc);
+	open_session(&dev, &opts, loc);
+
+	if (opts.routes)
+		apply_route(&dev, &opts);
+
+	identify_device(&dev);
+
+	if (opts.link_bench)
+		return link_bench(&dev, opts.bench_file);
+
+	prepare_images(&dev, &opts);
+
+	return run_session(&dev, &opts);
+}
+
 /*
  * Local Variables:
  * mode: c
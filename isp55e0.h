@@ -4,6 +4,29 @@
 
 #define XOR_KEY_LEN 8
 
+/* Serial ports driven at once by the serial engine */
+#define MAX_PORTS 64
+
+/* Payload of a code / data flash write or compare request */
+#define FLASH_CHUNK_SIZE 56
+
+/* Enough to erase the flash. */
+#define USB_TIMEOUT 5000 // milliseconds
+
+#define CMD_CHIP_TYPE        0xa1
+#define CMD_REBOOT           0xa2
+#define CMD_SET_KEY          0xa3
+#define CMD_ERASE_CODE_FLASH 0xa4
+#define CMD_WRITE_CODE_FLASH 0xa5
+#define CMD_CMP_CODE_FLASH   0xa6
+#define CMD_READ_CONFIG      0xa7
+#define CMD_WRITE_CONFIG     0xa8
+#define CMD_ERASE_DATA_FLASH 0xa9
+#define CMD_WRITE_DATA_FLASH 0xaa
+#define CMD_READ_DATA_FLASH  0xab
+
+#define N_CMDS (CMD_READ_DATA_FLASH - CMD_CHIP_TYPE + 1)
+
 /* Serial port wrapper magics */
 #define SERIAL_REQ_MAGIC1 (0x57)
 #define SERIAL_REQ_MAGIC2 (0xAB)
@@ -27,15 +50,465 @@ struct ch_profile {
 	bool clear_cfg_rom_read; /* Flashing will fail if this bit is set */
 };
 
+/* How long to wait for each command. In adaptive mode, erases scale
+ * with the erased size, and other commands with their measured round
+ * trips. */
+struct timeout_policy {
+	bool adaptive;
+	unsigned int fixed_ms;		/* timeout when not adaptive */
+	unsigned int initial_ms;	/* until enough round trips are known */
+	unsigned int min_ms;		/* floor of the adaptive timeouts */
+	double rtt_factor;		/* timeout is rtt_factor * p99 */
+	unsigned int erase_base_ms;	/* erase timeout is erase_base_ms + */
+	unsigned int erase_ms_per_kib;	/* erase_ms_per_kib * KiB */
+};
+
+/* Number of round trips kept for the latency percentiles */
+#define RTT_SAMPLES 256
+
+/* Histogram of all the round trips of a session, for the tail
+ * latency: 20 buckets per decade, from 1 us */
+#define RTT_BUCKETS 128
+#define RTT_BUCKET_MIN_MS 0.001
+#define RTT_BUCKET_RATIO 1.1220184543	/* 10^(1/20) */
+
+/* Adaptive timeouts need that many round trips of a command */
+#define RTT_WARMUP 8
+
+/* Silence on the link before a command is sent again */
+#define DRAIN_QUIET_MS 20
+
+/* Transfer statistics of a command */
+struct cmd_stats {
+	unsigned int count;
+	unsigned int errors;
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+	double total_ms;
+	double max_ms;
+	double p99_ms;			/* cached, refreshed as samples come */
+	unsigned int timeout_ms;	/* last timeout used */
+	float samples[RTT_SAMPLES];	/* last round trips, in ms */
+	unsigned int hist[RTT_BUCKETS];	/* all the round trips */
+};
+
+/* Commands sent in a row, to keep the sequence of a session */
+struct cmd_run {
+	uint8_t cmd;
+	unsigned int count;
+};
+
 /* Content of either a file or one of the flash section */
 struct content {
 	char *filename;
+	int fd;
+	bool stream;	/* file is a pipe or FIFO, and can't be sized */
 	bool encrypted;	/* whether the data in buf has been encrypted */
 	size_t len;
 	size_t max_flash_size;
 	uint8_t *buf;
+	uint32_t crc;	/* of the plain content, if crc_valid */
+	bool crc_valid;	/* only set once buf won't change */
+};
+
+/* What a bootloader version allows, or needs */
+struct bootloader_rules {
+	uint32_t version;
+	bool wait_reboot_resp;	/* wait for reboot command response */
+	bool sticky_cmp_failure; /* after a failed compare, all compares fail */
+};
+
+/* Operations requested for a session */
+struct session_ops {
+	bool code_flash;
+	bool code_verify;
+	bool data_flash;
+	bool data_verify;
+	bool data_dump;
+	bool write_config;
+	bool full;		/* don't drop any command */
+	int interleave;		/* chunks per write / verify region, or 0 */
+};
+
+/* Steps of a session, in the order the planner puts them */
+enum step {
+	STEP_SET_KEY,
+	STEP_WRITE_CONFIG,
+	STEP_ERASE_CODE,
+	STEP_WRITE_CODE,
+	STEP_VERIFY_CODE,
+	STEP_ERASE_DATA,
+	STEP_WRITE_DATA,
+	STEP_READ_DATA,
+	STEP_VERIFY_DATA,
+	STEP_DUMP_DATA,
+	STEP_REBOOT,
+};
+
+#define N_STEPS (STEP_REBOOT + 1)
+
+#define MAX_STEPS 32
+
+/* Commands to send for a session */
+struct plan {
+	enum step steps[MAX_STEPS];
+	int n;
+	size_t data_read_len;	/* how much of the data flash to read */
+	int interleave;		/* verify every n chunks while writing, or 0 */
+};
+
+/* Flight recorder file. A header, then fixed size records. Records
+ * are reserved by bumping next, and chained by chip ID hash. */
+#define REC_MAGIC "ISPREC01"
+#define REC_BUCKETS 4096
+
+struct rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;	/* number of records the file can hold */
+	uint64_t next;		/* next free record */
+	uint64_t buckets[REC_BUCKETS]; /* 1 + latest record for an ID hash */
+};
+
+/* One session on one chip */
+struct flight_record {
+	uint64_t committed;	/* set last, once the record is complete */
+	uint64_t prev;		/* 1 + previous record with the same ID hash */
+	int64_t start_us;	/* wall clock, in microseconds */
+	int64_t end_us;
+	uint8_t id[8];
+	uint8_t id_len;
+	uint8_t family;
+	uint8_t type;
+	uint8_t result;		/* 0 on success */
+	uint8_t last_step;	/* step running when the session ended */
+	uint8_t _pad[3];
+	uint32_t bv;
+	uint8_t config_before[12];
+	uint8_t config_after[12];
+	char chip[16];
+	char code_image[48];
+	char data_image[48];
+	uint32_t code_crc;
+	uint32_t code_len;
+	uint32_t data_crc;
+	uint32_t data_len;
+	float identify_ms;
+	float step_ms[N_STEPS];
+};
+
+#define REC_DEFAULT_CAPACITY 100000
+
+/* Flight recorder file, once mapped */
+struct recorder {
+	struct rec_header *hdr;
+	struct flight_record *records;
+	size_t map_len;
+};
+
+/* Data flash archive. A header, fixed size entries, then the blobs of
+ * data flash content, each stored once. Entries are chained by chip ID
+ * hash, and blobs by content hash. */
+#define ARC_MAGIC "ISPARC01"
+#define ARC_BUCKETS 4096
+
+struct arc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t capacity;	/* number of entries the file can hold */
+	uint64_t blob_space;	/* bytes for the blobs */
+	uint64_t next;		/* next free entry */
+	uint64_t blob_used;	/* bytes used by the blobs */
+	uint64_t n_blobs;
+	uint64_t id_buckets[ARC_BUCKETS]; /* 1 + latest entry for an ID hash */
+	uint64_t blob_buckets[ARC_BUCKETS]; /* 1 + offset of a blob */
+};
+
+/* One harvested board */
+struct arc_entry {
+	uint64_t prev;		/* 1 + previous entry with the same ID hash */
+	uint64_t blob;		/* offset of its data flash blob */
+	int64_t time_us;	/* wall clock, in microseconds */
+	uint8_t id[8];
+	uint8_t id_len;
+	uint8_t family;
+	uint8_t type;
+	uint8_t _pad[5];
+	char chip[16];
+};
+
+/* Some data flash content, 8 bytes aligned in the blob space */
+struct arc_blob {
+	uint64_t next;		/* 1 + offset of the next blob in the bucket */
+	uint64_t hash;
+	uint32_t len;
+	uint32_t refs;		/* number of entries with that content */
+	uint8_t data[];
+};
+
+#define ARC_DEFAULT_CAPACITY 100000
+#define ARC_DEFAULT_BLOB_SPACE (64 * 1024 * 1024)
+
+/* Data flash archive file, once mapped */
+struct archive {
+	struct arc_header *hdr;
+	struct arc_entry *entries;
+	uint8_t *blobs;
+	size_t map_len;
+	int fd;			/* kept open for the lock */
+};
+
+/* Where a device is, for the modes handling several devices */
+struct location {
+	char name[64];		/* usb:BUS-PORT.PORT... or the serial port */
+	const char *port;	/* serial port, or NULL for USB */
+	uint8_t bus;
+	uint8_t path[8];	/* USB port numbers from the root hub */
+	int path_len;
+	char group[64];		/* transaction translator the device sits behind */
+};
+
+#ifndef WIN32
+/* Sessions running in child processes, their output going through a
+ * pipe each */
+struct sessions {
+	int n;
+	pid_t *pids;
+	int *fds;
+};
+#endif
+
+/* Waiting for the application to enumerate after the reboot */
+#define APP_WAIT_DEADLINE_MS 10000
+#define APP_WATCH_SLICE_MS 10	/* between two checks for an arrival */
+
+struct app_wait {
+	uint16_t vid;		/* 0 for any new device on the ISP port */
+	uint16_t pid;
+	unsigned int deadline_ms;
+	bool isp_on_usb;	/* isp is where the ISP device was */
+	struct location isp;
+	bool hotplug;
+	libusb_hotplug_callback_handle cb;
+	struct location present[MAX_PORTS]; /* taken for the app before */
+	int n_present;
+#ifndef WIN32
+	pthread_t thread;	/* watching the devices from before the reboot */
+	pthread_mutex_t lock;	/* for the arrival */
+	volatile int stop;
+#endif
+	double reboot_ms;	/* when the reboot command was sent */
+	double left_ms;		/* when the ISP device left, or 0 */
+	double arrived_ms;	/* when the application arrived, or 0 */
+	struct location app;
+	uint16_t app_vid;
+	uint16_t app_pid;
 };
 
+/* Link benchmark. Each test runs for a number of requests, or a
+ * time, whichever comes first. */
+#define BENCH_SAMPLES 200
+#define BENCH_TEST_MS 350
+#define BENCH_MAX_TESTS 8
+#define BENCH_REGRESSION 1.25	/* slower than the baseline by 25% */
+
+struct bench_result {
+	char name[16];
+	unsigned int count;
+	double min_ms;
+	double p50_ms;
+	double p99_ms;
+	double max_ms;
+	double jitter_ms;	/* mean difference between consecutive trips */
+	double kib_s;		/* payload throughput, 0 if no payload */
+};
+
+/* Images to use for a given chip, from the routing table */
+struct route {
+	char *pattern;		/* chip name, or family/type, may use * and ? */
+	struct content fw;
+	struct content data;
+	bool skip_config;	/* don't write the configuration */
+};
+
+/* Job manifest. Operations run in order, in a single session, each
+ * with its own image. */
+enum job_op_type {
+	JOB_DUMP_DATA,
+	JOB_WRITE_CODE,
+	JOB_VERIFY_CODE,
+	JOB_WRITE_DATA,
+	JOB_VERIFY_DATA,
+	JOB_WRITE_CONFIG,
+	JOB_REBOOT,
+};
+
+#define MAX_JOB_OPS 16
+#define MAX_JOB_KEEPS 4
+
+/* Data flash region kept as it is when writing the data flash */
+struct job_keep {
+	size_t offset;
+	size_t len;
+};
+
+struct job_op {
+	enum job_op_type type;
+	int line;
+	struct content content;	/* image to use, or file to dump into */
+	struct content *image;	/* this content, or the one of an earlier op */
+	struct job_keep keep[MAX_JOB_KEEPS];
+	int n_keep;
+};
+
+struct job {
+	const char *filename;
+	struct job_op ops[MAX_JOB_OPS];
+	int n;
+};
+
+/* Data flash personalization. Each field is rendered at its offset
+ * once the chip ID is known. */
+enum field_type {
+	FIELD_BYTES,		/* constant bytes */
+	FIELD_ID,		/* chip unique ID */
+	FIELD_MAC,		/* MAC address, prefix + 3 bytes from the ID */
+	FIELD_COUNTER,		/* little endian counter, kept in a file */
+	FIELD_TIME,		/* little endian seconds since the epoch */
+	FIELD_CRC32,		/* little endian CRC32 of a range */
+};
+
+#define FIELD_MAX_BYTES 64
+
+struct field {
+	enum field_type type;
+	unsigned int offset;
+	unsigned int len;
+	uint8_t bytes[FIELD_MAX_BYTES]; /* constant bytes, or MAC prefix */
+	char *counter_file;
+	unsigned int from;	/* CRC range */
+	unsigned int to;
+};
+
+struct data_template {
+	char *filename;
+	struct field *fields;
+	int n;
+	size_t size;		/* rendered size, 0 for the end of the last field */
+	uint8_t fill;
+};
+
+/* Per-device value patched into the code image */
+enum patch_source {
+	PATCH_COUNTER,		/* little endian counter, kept in a file */
+	PATCH_COUNTER_STR,	/* same, as zero padded decimal text */
+	PATCH_ID,		/* chip unique ID */
+	PATCH_ID_STR,		/* chip unique ID, as hex text */
+	PATCH_LIST,		/* next line of a list */
+};
+
+#define MAX_PATCHES 16
+
+struct patch {
+	unsigned int offset;
+	unsigned int width;	/* bytes in the image */
+	enum patch_source source;
+	char *filename;		/* counter or list file */
+	bool utf16;		/* text in UTF-16LE, as in USB descriptors */
+};
+
+/* Progress records, written without blocking to a pipe or a file */
+#define PROGRESS_INTERVAL_MS 100
+#define JSON_ESCAPE_MAX 7	/* escaped character, with sprintf's NUL */
+
+struct progress {
+	int fd;			/* -1 when off */
+	const char *name;	/* port, or usb */
+	const char *phase;	/* phase being reported */
+	double start_ms;	/* when the phase started */
+	double last_ms;		/* when the last record was written */
+	size_t last_done;
+};
+
+/* Emulated bootloader, answering the requests in place of a device */
+struct emulator {
+	const struct ch_profile *profile;
+	const struct bootloader_rules *rules;
+	uint8_t id[8];
+	uint8_t config[12];
+	uint8_t key[XOR_KEY_LEN];
+	bool key_set;
+	bool cmp_failed;
+	uint8_t last_cmd;
+	uint8_t *code;
+	uint8_t *data;
+	bool serial;		/* reached through serial frames */
+	uint8_t rx[256];	/* sent to the host, not read yet */
+	int rx_len;
+};
+
+/* Faults injected on the link to the emulated chip. The time is
+ * virtual: nothing waits, the latencies are only accounted. */
+struct link_faults {
+	uint64_t rng;		/* random state, from the seed */
+	double latency_ms;	/* of each round trip */
+	double jitter_ms;	/* spread around the latency */
+	bool normal;		/* normal jitter, otherwise uniform */
+	double drop;		/* probabilities of each fault */
+	double truncate;
+	double corrupt;
+	double stall;
+	double stall_ms;	/* added by a stall */
+	double clock_ms;	/* virtual time spent on the link */
+	unsigned int transfers;
+	unsigned int dropped;
+	unsigned int truncated;
+	unsigned int corrupted;
+	unsigned int stalled;
+	unsigned int retried;
+};
+
+/* Sequence of modem control line or GPIO changes, to get a board
+ * into its bootloader, or to reset it */
+enum line_op {
+	LINE_DTR,
+	LINE_RTS,
+	LINE_GPIO,
+	LINE_WAIT,
+};
+
+#define MAX_LINE_ACTIONS 32
+#define MAX_GPIO_LINES 8
+#define ENTER_RETRIES 5
+
+struct line_action {
+	enum line_op op;
+	int value;		/* line level, or milliseconds to wait */
+	int gpio;		/* index of the GPIO line */
+};
+
+struct line_seq {
+	struct line_action actions[MAX_LINE_ACTIONS];
+	int n;
+};
+
+/* A GPIO line, requested once and held for the whole session */
+struct gpio_line {
+	char chip[64];
+	unsigned int offset;
+	int fd;
+};
+
+#ifdef __linux__
+/* FTDI latency timer changed for the session */
+struct latency_timer {
+	char path[PATH_MAX];
+	char value[8];		/* as read from sysfs */
+};
+#endif
+
 /* Current device */
 struct device {
 	const struct ch_profile *profile;
@@ -44,31 +517,192 @@ struct device {
 	struct content data;	/* read data from */
 	struct content data_dump; /* write the data flash into */
 	libusb_device_handle *usb_h;
+	struct emulator *emu;	/* emulated device, instead of USB or serial */
+	struct link_faults *faults; /* injected on the link to emu */
+	int retries;		/* for the commands which can be repeated */
 	uint32_t bv;		/* bootloader version */
 	uint8_t id[8];
 	uint8_t config_data[12];
 	uint8_t xor_key[XOR_KEY_LEN];
-	bool wait_reboot_resp;	/* wait for reboot command response */
+	size_t erase_size;	/* code flash to erase when streaming, or 0 */
+	const struct bootloader_rules *rules;
+	struct timeout_policy timeouts;
+	struct cmd_stats stats[N_CMDS];
+	struct cmd_run *runs;	/* sequence of the commands sent */
+	int n_runs;
+	int64_t start_us;	/* wall clock time the session started */
+	double session_start;	/* monotonic ms, for the deadline */
+	unsigned int deadline_ms; /* length allowed to the session, or 0 */
+	double identify_ms;	/* time to identify the chip */
+	double reboot_ms;	/* when the reboot command was sent */
+	int step;		/* step being run, or -1 */
+	float step_ms[N_STEPS];	/* time spent in each step */
+	uint8_t config_after[12]; /* configuration written, if any */
+	bool config_written;
+	const struct patch *patches;
+	int n_patches;
+	uint8_t *patch_values;	/* rendered, width bytes for each patch */
+	struct progress progress;
 #ifndef WIN32
         int fd; /* serial port descriptor */
+	bool low_latency;	/* adapter latency could be lowered */
+	const struct line_seq *enter_seq; /* to get into the bootloader */
+	const struct line_seq *reset_seq; /* to start the application */
+	struct archive *archive; /* to harvest the data flash into */
+#endif
+#ifdef __linux__
+	struct gang *gang;	/* shared with the other gang sessions, or NULL */
+	int gang_member;	/* index in the gang */
 #endif
 };
 
-/* Enough to erase the flash. */
-#define USB_TIMEOUT 5000 // milliseconds
-#define SERIAL_TIMEOUT 50 // deciseconds
+#ifdef __linux__
+/* State of a board driven by the serial engine */
+enum board_state {
+	BOARD_CHIP_TYPE,
+	BOARD_READ_CONFIG,
+	BOARD_SET_KEY,
+	BOARD_WRITE_CONFIG,
+	BOARD_ERASE,
+	BOARD_WRITE,
+	BOARD_LAST_WRITE,
+	BOARD_VERIFY_KEY,
+	BOARD_VERIFY,
+	BOARD_REBOOT,
+	BOARD_DONE,
+	BOARD_FAILED,
+};
 
-#define CMD_CHIP_TYPE        0xa1
-#define CMD_REBOOT           0xa2
-#define CMD_SET_KEY          0xa3
-#define CMD_ERASE_CODE_FLASH 0xa4
-#define CMD_WRITE_CODE_FLASH 0xa5
-#define CMD_CMP_CODE_FLASH   0xa6
-#define CMD_READ_CONFIG      0xa7
-#define CMD_WRITE_CONFIG     0xa8
-#define CMD_ERASE_DATA_FLASH 0xa9
-#define CMD_WRITE_DATA_FLASH 0xaa
-#define CMD_READ_DATA_FLASH  0xab
+/* One serial attached board in the serial engine */
+struct board {
+	struct device dev;
+	const char *port;
+	int index;		/* in the boards, for the epoll events */
+	int epoll_fd;
+	int timer_fd;
+	enum board_state state;
+	enum board_state failed_state;
+	const struct content *image; /* shared, not encrypted */
+	bool flash;		/* write the image, otherwise only verify */
+	bool write_config;
+	size_t offset;		/* in the image */
+	size_t resp_len;	/* expected frame length */
+	size_t rx_len;
+	uint8_t rx[128];
+	uint8_t tx[128];	/* frame being sent */
+	size_t tx_len;
+	size_t tx_off;		/* already written */
+	bool tx_waiting;	/* for the port to be writable */
+	uint8_t cmd;		/* command in flight */
+	size_t req_len;
+	double sent_ms;
+	int tries;		/* sends left for the command in flight */
+	bool draining;		/* dropping late data before sending again */
+	const char *error;
+	bool stopped;		/* at a command boundary, not failed */
+	struct timespec start;
+	struct timespec end;
+};
+
+/* Watch mode. The firmware is reloaded once its writes have settled,
+ * and the device is polled for until it is back in ISP mode. */
+#define WATCH_SETTLE_MS 300
+#define WATCH_POLL_MS 200
+
+/* Real time mode for the transfers */
+struct realtime {
+	int policy;		/* SCHED_FIFO or SCHED_RR */
+	int priority;
+	cpu_set_t cpus;		/* to run on, or none for the current ones */
+};
+
+/* Gang sessions. The full speed devices behind a same transaction
+ * translator share its bandwidth, so the sessions of a TT group take
+ * turns on a limited number of transfer slots. The limit is tuned
+ * while flashing, by looking at the group throughput. */
+#define GANG_TUNE_TRANSFERS 128	/* transfers in a tuning window */
+#define GANG_WAIT_SLICE_MS 100	/* between checks for a stop */
+
+struct gang_group {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char name[64];
+	int members;
+	int in_flight;		/* transfers in progress */
+	int limit;		/* transfers allowed in flight */
+	int direction;		/* of the next limit change, +1 or -1 */
+	int transfers;		/* in the current window */
+	uint64_t bytes;		/* in the current window */
+	double window_ms;	/* start of the current window */
+	double last_rate;	/* bytes per ms in the previous window */
+	int min_limit;		/* range the limit went over */
+	int max_limit;
+};
+
+struct gang_member {
+	pthread_mutex_t alive;	/* held by the session until it exits */
+	int group;
+	size_t job_size;	/* code flash size, once identified */
+	bool waiting;		/* for a transfer slot */
+	int slots;		/* transfer slots held */
+};
+
+struct gang {
+	int n_groups;
+	int n_members;
+	struct gang_group groups[MAX_PORTS];
+	struct gang_member members[MAX_PORTS];
+};
+#endif
+
+/* Command line options, besides the device settings */
+struct options {
+	bool code_flash;
+	bool code_verify;
+	bool data_flash;
+	bool data_verify;
+	bool data_dump;
+	bool config;		/* write the configuration when flashing */
+	bool full_plan;		/* send every command */
+	int interleave;
+	bool stats;
+	bool scan;
+	bool discover;
+	char *discover_patterns;
+	bool link_bench;
+	char *bench_file;
+	bool wait_app;
+	struct app_wait app_wait;
+	struct line_seq enter_seq;
+	struct line_seq reset_seq;
+	struct link_faults faults;
+	char *emulate;
+	char *model_file;
+	double model[N_CMDS];
+	char *budget_file;
+	char *tpl_file;
+	struct data_template data_tpl;
+	struct patch patches[MAX_PATCHES];
+	char *record_file;
+	char *harvest_file;
+	char *query;
+	char *route_file;
+	struct route *routes;
+	int n_routes;
+	char *job_file;
+	struct job job;
+	char *ports[MAX_PORTS];
+	int n_ports;
+#ifndef WIN32
+	struct archive archive;
+#endif
+#ifdef __linux__
+	bool gang;
+	bool realtime;
+	struct realtime rt;
+	bool watch;
+#endif
+};
 
 struct req_hdr {
 	uint8_t command;
@@ -145,7 +779,7 @@ struct req_flash_rw {
 	struct req_hdr hdr;
 	uint32_t offset;	/* ROM offset */
 	uint8_t _u1;		/* some checksum? */
-	uint8_t data[56];
+	uint8_t data[FLASH_CHUNK_SIZE];
 } __attribute__((__packed__));
 
 struct resp_flash_rw {
@@ -185,3 +819,19 @@ struct resp_read_data_flash {
 	uint16_t return_code;
 	uint8_t data[58];
 } __attribute__((__packed__));
+
+/* Ports probed for a bootloader. The by-path names come first, so a
+ * port is reported under its stable name. */
+#define DISCOVER_PATTERNS "/dev/serial/by-path/*,/dev/ttyUSB*,/dev/ttyACM*"
+
+#ifndef WIN32
+/* A serial port being probed, and its answer frame */
+struct probe {
+	char *port;
+	char *real;		/* resolved device node, to skip duplicates */
+	int fd;
+	size_t rx_len;
+	uint8_t rx[2 + sizeof(struct resp_chip_type) + 1];
+	const struct ch_profile *profile;
+};
+#endif
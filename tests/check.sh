@@ -0,0 +1,45 @@
+#!/bin/sh
+# Dry runs of a small and a large chip, over USB and serial, checked
+# against the command budgets in this directory. A budget is updated by
+# removing it and running the session again with -B.
+
+cd "$(dirname "$0")" || exit 1
+
+isp55e0=../isp55e0
+failed=0
+
+# Images of a fixed content, so that the budgets don't move
+head -c 12000 /dev/zero | tr '\000' '\125' > small.bin
+head -c 60000 /dev/zero | tr '\000' '\252' > large.bin
+head -c 128 /dev/zero | tr '\000' '\042' > data.bin
+
+check()
+{
+	name=$1
+	shift
+
+	if [ ! -f "$name.budget" ]; then
+		echo "$name: no budget"
+		failed=1
+		return
+	fi
+
+	if "$isp55e0" "$@" -B "$name.budget" > "$name.log" 2>&1; then
+		echo "$name: ok"
+		rm -f "$name.log"
+	else
+		cat "$name.log"
+		echo "$name: FAILED"
+		failed=1
+	fi
+}
+
+check ch552-usb --dry-run CH552,2.4.0 -f small.bin -k data.bin
+check ch552-serial --dry-run CH552,2.4.0,serial -f small.bin -k data.bin
+check ch552-interleave --dry-run CH552,2.4.0 -f small.bin -i
+check ch32v203-usb --dry-run CH32V203C8T6,2.6.0 -f large.bin
+check ch32v203-serial --dry-run CH32V203C8T6,2.6.0,serial -f large.bin
+
+rm -f small.bin large.bin data.bin
+
+exit $failed